@@ -0,0 +1,55 @@
+import os
+import tempfile
+import time
+
+import zengl_export
+from test_scene import make_scene
+
+ctx = make_scene()
+
+with tempfile.TemporaryDirectory() as cache_dir:
+    expected = zengl_export.dumps(ctx)
+
+    # miss: the export is formatted and stored as <sha256>.txt
+    assert zengl_export.dumps(ctx, cache_dir=cache_dir) == expected
+    entries = os.listdir(cache_dir)
+    assert len(entries) == 1 and len(entries[0]) == 68 and entries[0].endswith('.txt')
+    first = os.path.join(cache_dir, entries[0])
+    with open(first) as f:
+        assert f.read() == expected
+
+    # hit: the stored file is returned as it is, identical to a fresh export
+    assert zengl_export.dumps(ctx, cache_dir=cache_dir) == expected
+    assert os.listdir(cache_dir) == entries
+    with open(first, 'w') as f:
+        f.write('cached')
+    assert zengl_export.dumps(ctx, cache_dir=cache_dir) == 'cached'
+    assert zengl_export.dumps(ctx, cache_dir=os.fsencode(cache_dir)) == 'cached'
+
+    # other options are cached separately
+    persistent = zengl_export.dumps(ctx, persistent_buffers=True)
+    old = time.time() - 2 * 3600
+    os.utime(first, (old, old))
+
+    unrelated = os.path.join(cache_dir, 'notes.txt')
+    stale_temp = os.path.join(cache_dir, entries[0] + '.1.2.tmp')
+    fresh_temp = os.path.join(cache_dir, entries[0] + '.3.4.tmp')
+    for path in [unrelated, stale_temp, fresh_temp]:
+        with open(path, 'w') as f:
+            f.write('x' * 100000)
+    os.utime(stale_temp, (old, old))
+
+    # eviction: only room for the new entry, the least recently used one is removed
+    cache_size = len(persistent.encode())
+    assert zengl_export.dumps(ctx, persistent_buffers=True, cache_dir=cache_dir, cache_size=cache_size) == persistent
+
+    names = sorted(os.listdir(cache_dir))
+    assert not os.path.exists(first)
+    assert not os.path.exists(stale_temp)
+    assert os.path.exists(unrelated)
+    assert os.path.exists(fresh_temp)
+    assert len([name for name in names if len(name) == 68 and name.endswith('.txt')]) == 1
+
+    assert zengl_export.dumps(ctx, persistent_buffers=True, cache_dir=cache_dir, cache_size=cache_size) == persistent
+
+print('ok')
@@ -0,0 +1,66 @@
+import re
+
+import zengl_export
+from test_scene import check_compiles, make_scene
+
+
+def function_body(text, name):
+    begin = text.index('void %s() {\n' % name)
+    end = text.index('\n}\n', begin)
+    return text[begin:end]
+
+
+ctx = make_scene()
+
+for options in [{}, {'separate_vertex_format': True, 'invalidate_framebuffers': True, 'pack_buffers': True, 'persistent_buffers': True, 'texture_arrays': True}]:
+    text = zengl_export.dumps(ctx, frame_replay=True, **options)
+    check_compiles(text, frame_replay=True)
+
+    init = function_body(text, 'init')
+    render_frame = function_body(text, 'render_frame')
+    shutdown = function_body(text, 'shutdown')
+    assert text.index('void init() {') < text.index('void render_frame() {') < text.index('void shutdown() {')
+
+    # objects are globals created once by init and deleted by shutdown
+    handles = re.findall(r'^unsigned (\w+) = 0;$', text, re.M)
+    assert handles
+    for name in handles:
+        assert re.search(r'\b%s\b' % name, init)
+        assert re.search(r'\b%s\b' % name, shutdown)
+    assert 'glGen' not in render_frame
+
+    assert not re.search(r'^    (unsigned|int|char \*|const char \*) \w+ = ', init, re.M)
+    assert re.findall(r'^unsigned (shader\d+) = 0;$', text, re.M)
+    assert re.findall(r'^    (shader\d+) = glCreateShader\(', init, re.M)
+
+    # the draws are a table walked by render_frame
+    assert 'const int command_count = 3;\n' in text
+    commands = text[text.index('const Command commands[] = {\n'):text.index('const int command_count')]
+    rows = re.findall(r'^    \{(\w+), (global_settings\d+), \{0, 0, (\d+), (\d+)\}, &(framebuffer\d+), ', commands, re.M)
+    assert [(width, height) for clear, settings, width, height, framebuffer in rows] == [('256', '256'), ('1280', '720'), ('1280', '720')]
+    assert rows[0][4] != rows[1][4] == rows[2][4]
+    assert text.count('void global_settings') < 3
+    assert 'for (int i = 0; i < command_count; ++i) {' in render_frame
+    assert 'glBlitFramebuffer(' in render_frame
+
+    # with invalidation each framebuffer is cleared once, before its first command
+    clears = [clear for clear, settings, width, height, framebuffer in rows]
+    if options:
+        assert clears == ['clear0', 'clear1', 'NULL']
+        assert 'glClearBufferfv(GL_DEPTH, 0, ' in function_body(text, 'clear0')
+        assert 'glClearBufferfv(GL_COLOR, 0, ' in function_body(text, 'clear1')
+    else:
+        assert clears == ['NULL', 'NULL', 'NULL']
+        assert 'glClearBuffer' not in text
+
+text = zengl_export.dumps(ctx, frame_replay=True, pack_buffers=True, persistent_buffers=True, texture_arrays=True)
+shutdown = function_body(text, 'shutdown')
+
+assert 'glDeleteBuffers(1, &buffer_pool);\n' in shutdown
+assert 'glDeleteTextures(1, &texture_array0);\n' in shutdown
+assert 'glDeleteSync(buffer_fence[0]);\n' in shutdown
+assert 'buffer_ring = 0;\n' in shutdown
+assert re.search(r'^char \* buffer\d+_map = 0;$', text, re.M)
+assert re.search(r'^int program\d+_texture_layers = 0;$', text, re.M)
+
+print('ok')
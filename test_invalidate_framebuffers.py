@@ -0,0 +1,45 @@
+import re
+
+import zengl_export
+from test_scene import check_compiles, make_scene
+
+ctx = make_scene()
+
+default = zengl_export.dumps(ctx)
+text = zengl_export.dumps(ctx, invalidate_framebuffers=True)
+check_compiles(text)
+
+assert 'glInvalidateFramebuffer' not in default
+
+blit = 'glBlitFramebuffer(0, 0, 1280, 720, 0, 0, 1280, 720, GL_COLOR_BUFFER_BIT, GL_NEAREST);\n'
+assert blit in default
+assert blit in text
+
+invalidates = dict(re.findall(r'unsigned (invalidate\d+)\[\] = \{(.*)\};', text))
+calls = re.findall(r'glInvalidateFramebuffer\((\w+), (\d+), (invalidate\d+)\);', text)
+
+# the offscreen depth and the multisampled depth are dropped after their last draw
+# the multisampled color is dropped after the resolve, the sampled offscreen color is kept
+assert sorted((target, invalidates[name]) for target, count, name in calls) == [
+    ('GL_FRAMEBUFFER', 'GL_DEPTH_ATTACHMENT'),
+    ('GL_FRAMEBUFFER', 'GL_DEPTH_ATTACHMENT'),
+    ('GL_READ_FRAMEBUFFER', 'GL_COLOR_ATTACHMENT0'),
+]
+assert all(int(count) == invalidates[name].count(',') + 1 for target, count, name in calls)
+assert text.index('glInvalidateFramebuffer(GL_READ_FRAMEBUFFER') > text.index(blit)
+
+# every invalidated attachment is cleared to its clear value before its first draw, the sampled color is not
+clears = re.findall(r'glClearBuffer(\w+)\((GL_\w+), (\d+), (\w+)_clear\);', text)
+assert sorted(clears) == [
+    ('fv', 'GL_COLOR', '0', 'renderbuffer1'),
+    ('fv', 'GL_DEPTH', '0', 'image2'),
+    ('fv', 'GL_DEPTH', '0', 'renderbuffer2'),
+]
+assert 'float image2_clear[] = {1.000000, 0.000000, 0.000000, 0.000000};\n' in text
+assert 'glClearBuffer' not in default
+assert 'image1_clear' not in text
+draws = [m.start() for m in re.finditer(r'glDraw(Arrays|Elements)Instanced\(', text)]
+assert text.index('image2_clear);') < draws[0] < text.index('renderbuffer1_clear);') < draws[1]
+assert text.index('renderbuffer2_clear);') < draws[1]
+
+print('ok')
@@ -0,0 +1,44 @@
+import re
+
+import zengl_export
+from test_scene import check_compiles, make_scene
+
+ctx = make_scene()
+
+default = zengl_export.dumps(ctx)
+text = zengl_export.dumps(ctx, pack_buffers=True)
+check_compiles(text)
+
+assert 'buffer_pool' not in default
+assert default.count('glGenBuffers(1, &buffer') == 5
+
+# the static vertex, index and quad buffers share the pool, the dynamic ones keep their own buffer
+assert text.count('glGenBuffers(1, &buffer_pool);\n') == 1
+assert text.count('glGenBuffers(1, &buffer') == 3
+assert text.count('GL_DYNAMIC_DRAW);\n') == 2
+
+pool_size = int(re.search(r'glBufferData\(GL_ARRAY_BUFFER, (\d+), NULL, GL_STATIC_DRAW\);', text).group(1))
+ranges = sorted((int(offset), int(size)) for offset, size in re.findall(r'glBufferSubData\(GL_ARRAY_BUFFER, (\d+), (\d+), data\);', text))
+offsets = {size: offset for offset, size in ranges}
+
+assert sorted(offsets) == [48, 96, 144]
+assert all(offset % 16 == 0 for offset, size in ranges)
+assert all(a + n <= b for (a, n), (b, _) in zip(ranges, ranges[1:]))
+assert ranges[-1][0] + ranges[-1][1] <= pool_size
+
+assert 'glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer_pool);\n' in text
+assert 'glVertexAttribPointer(0, 3, GL_FLOAT, false, 12, %d);\n' % offsets[96] in text
+assert 'glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, true, 16, %d);\n' % (offsets[48] + 12) in text
+assert 'glDrawElementsInstanced(GL_TRIANGLES, 36, GL_UNSIGNED_INT, %d + 0 * 4, 1);\n' % offsets[144] in text
+
+# the uniform buffer alignment must be a power of two
+assert zengl_export.dumps(ctx, pack_buffers=True, buffer_alignment=64) == text
+for alignment in [0, -256, 3, 48]:
+    try:
+        zengl_export.dumps(ctx, pack_buffers=True, buffer_alignment=alignment)
+    except ValueError as e:
+        assert 'power of two' in str(e)
+    else:
+        assert False
+
+print('ok')
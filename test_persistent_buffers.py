@@ -0,0 +1,46 @@
+import re
+
+import zengl_export
+from test_scene import check_compiles, make_scene
+
+ctx = make_scene()
+
+default = zengl_export.dumps(ctx)
+text = zengl_export.dumps(ctx, persistent_buffers=True)
+check_compiles(text)
+
+assert 'buffer_ring' not in default
+assert 'GL_DYNAMIC_DRAW' not in text
+
+flags = 'GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT'
+
+assert 'int buffer_ring = 0;\n' in text
+assert 'GLsync buffer_fence[3] = {};\n' in text
+
+# the 2048 byte vertex buffer and the 64 byte uniform buffer padded to the 256 byte alignment
+assert 'glBufferStorage(GL_ARRAY_BUFFER, 6144, NULL, %s);\n' % flags in text
+assert 'glBufferStorage(GL_ARRAY_BUFFER, 768, NULL, %s);\n' % flags in text
+assert text.count('(char *)glMapBufferRange(GL_ARRAY_BUFFER, 0, ') == 2
+
+# each slot of a ring is a stride apart, the stride covers the buffer and the storage holds three slots
+storage = dict(re.findall(r'glGenBuffers\(1, &(buffer\d+)\);\nglBindBuffer\(GL_ARRAY_BUFFER, buffer\d+\);\nglBufferStorage\(GL_ARRAY_BUFFER, (\d+), ', text))
+assert len(storage) == 2
+for name, size in storage.items():
+    stride = int(size) // 3
+    assert stride * 3 == int(size) and stride % 256 == 0
+    fills = re.findall(r'memcpy\(%s_map \+ (\d+), data, (\d+)\);' % name, text)
+    assert [int(offset) for offset, length in fills] == [0, stride, stride * 2]
+    assert all(int(length) <= stride for offset, length in fills)
+    assert re.search(r'memcpy\(%s_map \+ buffer_ring \* %d, data, %s\);' % (name, stride, fills[0][1]), text)
+
+assert re.search(r'glBindBufferRange\(GL_UNIFORM_BUFFER, 0, buffer\d+, 0 \+ buffer_ring \* 256, 64\);', text)
+assert 'glVertexAttribPointer(0, 3, GL_FLOAT, false, 16, 0 + buffer_ring * 2048);\n' in text
+assert 'glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, true, 16, 12 + buffer_ring * 2048);\n' in text
+
+wait = text.index('glClientWaitSync(buffer_fence[buffer_ring], GL_SYNC_FLUSH_COMMANDS_BIT, ')
+blit = text.index('glBlitFramebuffer(')
+fence = text.index('buffer_fence[buffer_ring] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);\n')
+advance = text.index('buffer_ring = (buffer_ring + 1) % 3;\n')
+assert wait < text.index('glDrawArraysInstanced(') < blit < fence < advance
+
+print('ok')
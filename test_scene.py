@@ -0,0 +1,189 @@
+import os
+import re
+import shutil
+import struct
+import subprocess
+import tempfile
+
+import zengl
+
+RETURN_TYPES = {
+    'glCreateShader': 'unsigned',
+    'glCreateProgram': 'unsigned',
+    'glGetUniformLocation': 'int',
+    'glMapBufferRange': 'void *',
+    'glFenceSync': 'GLsync',
+    'glClientWaitSync': 'unsigned',
+}
+
+
+def make_scene():
+    ctx = zengl.context(zengl.loader(headless=True))
+
+    image = ctx.image((1280, 720), 'rgba8unorm', samples=4)
+    depth = ctx.image((1280, 720), 'depth24plus', samples=4)
+
+    shadow = ctx.image((256, 256), 'rgba8unorm')
+    shadow_depth = ctx.image((256, 256), 'depth24plus')
+
+    pixels = b'\xff\x80\x00\xff' * 256 * 256
+    diffuse = ctx.image((256, 256), 'rgba8unorm', pixels)
+    detail = ctx.image((256, 256), 'rgba8unorm', pixels)
+
+    cube = ctx.buffer(struct.pack('24f', *[
+        -1.0, -1.0, -1.0, 1.0, -1.0, -1.0, 1.0, 1.0, -1.0, -1.0, 1.0, -1.0,
+        -1.0, -1.0, 1.0, 1.0, -1.0, 1.0, 1.0, 1.0, 1.0, -1.0, 1.0, 1.0,
+    ]), dynamic=False)
+    cube_index = ctx.buffer(struct.pack('36i', *[
+        0, 1, 2, 0, 2, 3, 4, 5, 6, 4, 6, 7, 0, 1, 5, 0, 5, 4,
+        2, 3, 7, 2, 7, 6, 1, 2, 6, 1, 6, 5, 0, 3, 7, 0, 7, 4,
+    ]), dynamic=False)
+    particles = ctx.buffer(size=16 * 128, dynamic=True)
+    quad = ctx.buffer(struct.pack('3f4B3f4B3f4B', *[
+        -1.0, -1.0, 0.0, 255, 255, 255, 255,
+        3.0, -1.0, 0.0, 255, 255, 255, 255,
+        -1.0, 3.0, 0.0, 255, 255, 255, 255,
+    ]), dynamic=False)
+    uniform_buffer = ctx.buffer(size=64, dynamic=True)
+
+    ctx.pipeline(
+        vertex_shader='''
+            #version 330
+
+            layout (std140) uniform Common {
+                mat4 mvp;
+            };
+
+            layout (location = 0) in vec3 in_vert;
+
+            void main() {
+                gl_Position = mvp * vec4(in_vert, 1.0);
+            }
+        ''',
+        fragment_shader='''
+            #version 330
+
+            layout (location = 0) out vec4 out_color;
+
+            void main() {
+                out_color = vec4(gl_FragCoord.z, 0.0, 0.0, 1.0);
+            }
+        ''',
+        layout=[
+            {
+                'name': 'Common',
+                'binding': 0,
+            },
+        ],
+        resources=[
+            {
+                'type': 'uniform_buffer',
+                'binding': 0,
+                'buffer': uniform_buffer,
+            },
+        ],
+        framebuffer=[shadow, shadow_depth],
+        vertex_buffers=zengl.bind(cube, '3f', 0),
+        index_buffer=cube_index,
+        topology='triangles',
+        vertex_count=36,
+    )
+
+    fragment_shader = '''
+        #version 330
+
+        uniform sampler2D Shadow;
+        uniform sampler2D Diffuse;
+        uniform sampler2D Detail;
+
+        in vec4 v_color;
+
+        layout (location = 0) out vec4 out_color;
+
+        void main() {
+            vec2 uv = gl_FragCoord.xy / 256.0;
+            out_color = v_color * texture(Diffuse, uv) * texture(Detail, uv) * texture(Shadow, uv).r;
+        }
+    '''
+
+    vertex_shader = '''
+        #version 330
+
+        layout (location = 0) in vec3 in_vert;
+        layout (location = 1) in vec4 in_color;
+
+        out vec4 v_color;
+
+        void main() {
+            gl_Position = vec4(in_vert, 1.0);
+            v_color = in_color;
+        }
+    '''
+
+    for vertex_buffer, topology, vertex_count in [(particles, 'points', 128), (quad, 'triangles', 3)]:
+        ctx.pipeline(
+            vertex_shader=vertex_shader,
+            fragment_shader=fragment_shader,
+            layout=[
+                {
+                    'name': 'Shadow',
+                    'binding': 0,
+                },
+                {
+                    'name': 'Diffuse',
+                    'binding': 1,
+                },
+                {
+                    'name': 'Detail',
+                    'binding': 2,
+                },
+            ],
+            resources=[
+                {
+                    'type': 'sampler',
+                    'binding': 0,
+                    'image': shadow,
+                },
+                {
+                    'type': 'sampler',
+                    'binding': 1,
+                    'image': diffuse,
+                },
+                {
+                    'type': 'sampler',
+                    'binding': 2,
+                    'image': detail,
+                },
+            ],
+            framebuffer=[image, depth],
+            vertex_buffers=zengl.bind(vertex_buffer, '3f 4nu1', 0, 1),
+            topology=topology,
+            vertex_count=vertex_count,
+        )
+
+    return ctx
+
+
+def check_compiles(text, frame_replay=False):
+    # the export is compiled against stub declarations, it only has to be valid C++
+    compiler = shutil.which('c++')
+    if compiler is None:
+        return
+    lines = ['#include <stdint.h>', '#include <string.h>', 'typedef struct GLsyncObject * GLsync;']
+    for i, name in enumerate(sorted(set(re.findall(r'\bGL_[A-Z0-9_]+\b', text)))):
+        lines.append('const unsigned %s = %d;' % (name, i + 1))
+    for name in sorted(set(re.findall(r'\b(gl[A-Z]\w*)\(', text))):
+        lines.append('template <typename... T> %s %s(T...);' % (RETURN_TYPES.get(name, 'void'), name))
+    lines.append('const char data[1 << 20] = {};')
+    if frame_replay:
+        lines.append(text)
+        lines.append('int main() { init(); render_frame(); render_frame(); shutdown(); }')
+    else:
+        lines.append('void export_body(unsigned framebuffer, int width, int height) {')
+        lines.append(text)
+        lines.append('}')
+    with tempfile.TemporaryDirectory() as path:
+        source = os.path.join(path, 'export.cpp')
+        with open(source, 'w') as f:
+            f.write('\n'.join(lines))
+        subprocess.run([compiler, '-fsyntax-only', '-Werror=return-type', source], check=True)
@@ -0,0 +1,32 @@
+import re
+
+import zengl_export
+from test_scene import check_compiles, make_scene
+
+ctx = make_scene()
+
+default = zengl_export.dumps(ctx)
+text = zengl_export.dumps(ctx, separate_vertex_format=True)
+check_compiles(text)
+
+assert 'glVertexAttribFormat' not in default
+assert 'glVertexAttribPointer' not in text
+
+# the position and the color of an interleaved vertex share one binding, the color at a relative offset
+assert 'glVertexAttribFormat(0, 3, GL_FLOAT, false, 0);\n' in text
+assert 'glVertexAttribFormat(1, 4, GL_UNSIGNED_BYTE, true, 12);\n' in text
+assert 'glVertexAttribBinding(0, 0);\n' in text
+assert 'glVertexAttribBinding(1, 0);\n' in text
+assert 'glVertexAttribBinding(1, 1);\n' not in text
+
+assert text.count('glGenVertexArrays(1, &vertex_layout') == 2
+assert text.count('glVertexBindingDivisor(0, 0);\n') == 2
+assert 'glVertexBindingDivisor(1, ' not in text
+
+# one vertex buffer bind per draw, with the stride of the interleaved vertex
+binds = re.findall(r'glBindVertexBuffer\((\d+), (\w+), (\d+), (\d+)\);', text)
+assert len(binds) == 3
+assert all(index == '0' and offset == '0' for index, name, offset, stride in binds)
+assert sorted(stride for index, name, offset, stride in binds) == ['12', '16', '16']
+
+print('ok')
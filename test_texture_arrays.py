@@ -0,0 +1,44 @@
+import re
+
+import zengl_export
+from test_scene import check_compiles, make_scene
+
+ctx = make_scene()
+
+default = zengl_export.dumps(ctx)
+text = zengl_export.dumps(ctx, texture_arrays=True)
+check_compiles(text)
+
+assert 'GL_TEXTURE_2D_ARRAY' not in default
+
+# the two plain textures are merged, the offscreen color attached to a framebuffer is not
+assert text.count('glGenTextures(1, &texture_array') == 1
+assert 'glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, 256, 256, 2, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);\n' in text
+assert 'glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, 0, 256, 256, 1, GL_RGBA, GL_UNSIGNED_BYTE, data);\n' in text
+assert 'glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, 1, 256, 256, 1, GL_RGBA, GL_UNSIGNED_BYTE, data);\n' in text
+assert sorted(re.findall(r'const int image\d+_layer = (\d+);', text)) == ['0', '1']
+assert 'glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 256, 256, 0, GL_RGBA, GL_UNSIGNED_BYTE, ' in text
+
+# only the program sampling the array looks up the uniform, and skips the upload for unadapted shaders
+locations = re.findall(r'int (program\d+)_texture_layers = glGetUniformLocation\((program\d+), "texture_layers"\);', text)
+assert len(locations) == 1 and locations[0][0] == locations[0][1]
+program = locations[0][0]
+uploads = re.findall(r'int (texture_layers\d+)\[\] = \{(.*)\};\nif \((\w+)_texture_layers != -1\) \{\n    glUniform1iv\((\w+)_texture_layers, 3, (texture_layers\d+)\);\n\}\n', text)
+assert len(uploads) == 2
+for array, values, checked, uploaded, source in uploads:
+    assert checked == uploaded == program and source == array and values == '0, 0, 1'
+
+# the units sampling merged images bind the same array, and the uploaded layers match the exported ones
+layers = {int(image): int(layer) for image, layer in re.findall(r'const int image(\d+)_layer = (\d+);', text)}
+units = re.findall(r'glActiveTexture\(GL_TEXTURE(\d+)\);\nglBindTexture\((GL_TEXTURE_2D\w*), (\w+)\);', text)
+arrays = {(unit, name) for unit, target, name in units if target == 'GL_TEXTURE_2D_ARRAY'}
+assert {unit for unit, name in arrays} == {'1', '2'}
+assert len({name for unit, name in arrays}) == 1
+plain = {int(name[5:]) for unit, target, name in units if target == 'GL_TEXTURE_2D'}
+assert not plain & set(layers)
+bound = dict(re.findall(r'glActiveTexture\(GL_TEXTURE(\d+)\);\nglBindTexture\(GL_TEXTURE_2D, image(\d+)\);', default))
+assert sorted(bound) == ['0', '1', '2']
+assert set(layers) == {int(bound['1']), int(bound['2'])}
+assert [layers.get(int(bound[str(unit)]), 0) for unit in range(3)] == [0, 0, 1]
+
+print('ok')
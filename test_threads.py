@@ -0,0 +1,58 @@
+import threading
+
+import zengl
+import zengl_export
+
+N = 8
+
+
+def make_context(index):
+    ctx = zengl.context(zengl.loader(headless=True))
+    image = ctx.image((64 * (index + 1), 64), 'rgba8unorm', samples=4)
+    ctx.pipeline(
+        vertex_shader='''
+            #version 330
+
+            void main() {
+                gl_Position = vec4(0.0, 0.0, 0.0, 1.0);
+            }
+        ''',
+        fragment_shader='''
+            #version 330
+
+            layout (location = 0) out vec4 out_color;
+
+            void main() {
+                out_color = vec4(%d.0, 0.0, 0.0, 1.0);
+            }
+        ''' % index,
+        framebuffer=[image],
+        topology='points',
+        vertex_count=1,
+    )
+    return ctx
+
+
+contexts = [make_context(i) for i in range(N)]
+expected = [zengl_export.dumps(ctx) for ctx in contexts]
+results = [None] * N
+barrier = threading.Barrier(N)
+
+
+def export(index):
+    barrier.wait()
+    for _ in range(100):
+        results[index] = zengl_export.dumps(contexts[index])
+        assert results[index] == expected[index]
+
+
+threads = [threading.Thread(target=export, args=(i,)) for i in range(N)]
+
+for thread in threads:
+    thread.start()
+
+for thread in threads:
+    thread.join()
+
+assert results == expected
+print('ok')
@@ -1,9 +1,22 @@
 #include <Python.h>
 
+#ifndef Py_BEGIN_CRITICAL_SECTION
+#define Py_BEGIN_CRITICAL_SECTION(op) {
+#define Py_END_CRITICAL_SECTION() }
+#define Py_BEGIN_CRITICAL_SECTION2(a, b) {
+#define Py_END_CRITICAL_SECTION2() }
+#endif
+
 const int MAX_ATTACHMENTS = 16;
 const int MAX_UNIFORM_BUFFER_BINDINGS = 16;
 const int MAX_SAMPLER_BINDINGS = 64;
 const int MAX_UNIFORM_BINDINGS = 64;
+const int MAX_VERTEX_ATTRIBUTES = 64;
+const int MAX_VERTEX_ATTRIB_RELATIVE_OFFSET = 2047;
+const int MAX_TEXTURE_ARRAY_LAYERS = 256;
+const int RING_SIZE = 3;
+
+const int GL_TEXTURE_2D = 0x0de1;
 
 struct VertexFormat {
     int type;
@@ -256,8 +269,96 @@ struct ImageFace {
     int color;
 };
 
-PyObject * json;
-PyObject * regex;
+struct ExportModuleState {
+    PyObject * json;
+    PyObject * compact_lines;
+    PyObject * hashlib;
+    PyObject * io;
+    PyObject * os;
+    PyObject * os_path;
+    PyObject * mmap;
+    PyObject * time;
+};
+
+struct Stream {
+    char * data;
+    int size;
+    int capacity;
+    int failed;
+};
+
+bool reserve_stream(Stream * stream, int size) {
+    if (stream->failed) {
+        return false;
+    }
+    if (stream->size + size + 1 > stream->capacity) {
+        int capacity = stream->capacity * 2 > stream->size + size + 1 ? stream->capacity * 2 : stream->size + size + 1;
+        char * data = (char *)realloc(stream->data, capacity);
+        if (!data) {
+            stream->failed = true;
+            return false;
+        }
+        stream->data = data;
+        stream->capacity = capacity;
+    }
+    return true;
+}
+
+void write_stream(Stream * stream, const char * data, int size) {
+    if (size && reserve_stream(stream, size)) {
+        memcpy(stream->data + stream->size, data, size);
+        stream->size += size;
+    }
+}
+
+void vprint_stream(Stream * stream, const char * format, va_list args) {
+    va_list copy;
+    va_copy(copy, args);
+    int size = vsnprintf(NULL, 0, format, copy);
+    va_end(copy);
+    if (size >= 0 && reserve_stream(stream, size)) {
+        vsnprintf(stream->data + stream->size, size + 1, format, args);
+        stream->size += size;
+    }
+}
+
+void print_stream(Stream * stream, const char * format, ...) {
+    va_list args;
+    va_start(args, format);
+    vprint_stream(stream, format, args);
+    va_end(args);
+}
+
+void release_stream(Stream * stream) {
+    free(stream->data);
+    stream->data = NULL;
+}
+
+struct Exporter {
+    int separate_vertex_format;
+    int invalidate_framebuffers;
+    int pack_buffers;
+    int persistent_buffers;
+    int texture_arrays;
+    int frame_replay;
+    int buffer_alignment;
+    PyObject * buffer_offsets;
+    PyObject * ring_strides;
+    PyObject * texture_layers;
+    PyObject * vertex_layouts;
+    PyObject * vertex_arrays;
+    PyObject * framebuffers;
+    PyObject * image_uses;
+    PyObject * sampled_images;
+    int current_vertex_layout;
+    int current_vertex_array;
+    int current_textures[MAX_SAMPLER_BINDINGS];
+    int current_samplers[MAX_SAMPLER_BINDINGS];
+    int pipeline_index;
+    int invalidate_count;
+    Stream globals;
+    Stream shutdown;
+};
 
 VertexFormat get_vertex_format(const char * format) {
     if (!strcmp(format, "uint8x2")) return {0x1401, 2, false, true};
@@ -383,6 +484,23 @@ const char * str_internal_format(int arg) {
     return "";
 }
 
+const char * str_depth_stencil_attachment(int arg) {
+    switch (arg) {
+        case 0x1801: return "GL_DEPTH_ATTACHMENT";
+        case 0x1802: return "GL_STENCIL_ATTACHMENT";
+    }
+    return "GL_DEPTH_STENCIL_ATTACHMENT";
+}
+
+const char * str_clear_buffer(int arg) {
+    switch (arg) {
+        case 0x1800: return "GL_COLOR";
+        case 0x1801: return "GL_DEPTH";
+        case 0x1802: return "GL_STENCIL";
+    }
+    return "GL_DEPTH_STENCIL";
+}
+
 const char * str_topology(int arg) {
     switch (arg) {
         case 0: return "GL_POINTS";
@@ -511,61 +629,210 @@ const char * str_stencil_op(int arg) {
     return "";
 }
 
-void print_buffer(char *& s, Buffer * buffer) {
-    s += sprintf(s, "unsigned buffer%d = 0;\n", buffer->buffer);
-    s += sprintf(s, "glGenBuffers(1, &buffer%d);\n", buffer->buffer);
-    s += sprintf(s, "glBindBuffer(GL_ARRAY_BUFFER, buffer%d);\n", buffer->buffer);
-    s += sprintf(s, "glBufferData(GL_ARRAY_BUFFER, %d, data, %s);\n", buffer->size, buffer->dynamic ? "GL_DYNAMIC_DRAW" : "GL_STATIC_DRAW");
+void print_global(Stream * s, Exporter * exporter, const char * format, ...) {
+    va_list args;
+    va_start(args, format);
+    vprint_stream(exporter->frame_replay ? &exporter->globals : s, format, args);
+    va_end(args);
+}
+
+void print_handle(Stream * s, Exporter * exporter, const char * type, const char * format, ...) {
+    char name[64];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(name, sizeof(name), format, args);
+    va_end(args);
+    if (exporter->frame_replay) {
+        print_stream(&exporter->globals, "%s %s = 0;\n", type, name);
+        print_stream(s, "%s = ", name);
+    } else {
+        print_stream(s, "%s %s = ", type, name);
+    }
+}
+
+void print_release(Exporter * exporter, const char * format, ...) {
+    va_list args;
+    va_start(args, format);
+    if (exporter->frame_replay) {
+        vprint_stream(&exporter->shutdown, format, args);
+    }
+    va_end(args);
+}
+
+Py_ssize_t align(Py_ssize_t offset, int alignment) {
+    return (offset + alignment - 1) & ~(Py_ssize_t)(alignment - 1);
+}
+
+struct BufferRef {
+    char name[32];
+    char offset[64];
+    int plain;
+};
+
+int lookup_buffer(PyObject * mapping, int buffer) {
+    PyObject * buffer_key = PyLong_FromLong(buffer);
+    PyObject * value = PyDict_GetItem(mapping, buffer_key);
+    Py_DECREF(buffer_key);
+    return value ? PyLong_AsLong(value) : -1;
+}
+
+int get_buffer_offset(Exporter * exporter, int buffer) {
+    return lookup_buffer(exporter->buffer_offsets, buffer);
+}
+
+int get_ring_stride(Exporter * exporter, int buffer) {
+    return lookup_buffer(exporter->ring_strides, buffer);
+}
+
+BufferRef get_buffer_ref(Exporter * exporter, int buffer, int offset) {
+    BufferRef res;
+    int pool_offset = get_buffer_offset(exporter, buffer);
+    int ring_stride = get_ring_stride(exporter, buffer);
+    if (pool_offset >= 0) {
+        sprintf(res.name, "buffer_pool");
+        offset += pool_offset;
+    } else {
+        sprintf(res.name, "buffer%d", buffer);
+    }
+    if (ring_stride >= 0) {
+        sprintf(res.offset, "%d + buffer_ring * %d", offset, ring_stride);
+    } else {
+        sprintf(res.offset, "%d", offset);
+    }
+    res.plain = pool_offset < 0 && ring_stride < 0;
+    return res;
+}
+
+void print_buffer_pool(Stream * s, Exporter * exporter, int size) {
+    print_global(s, exporter, "unsigned buffer_pool = 0;\n");
+    print_release(exporter, "glDeleteBuffers(1, &buffer_pool);\n");
+    print_stream(s, "glGenBuffers(1, &buffer_pool);\n");
+    print_stream(s, "glBindBuffer(GL_ARRAY_BUFFER, buffer_pool);\n");
+    print_stream(s, "glBufferData(GL_ARRAY_BUFFER, %d, NULL, GL_STATIC_DRAW);\n", size);
+}
+
+void print_pooled_buffer(Stream * s, Exporter * exporter, Buffer * buffer) {
+    print_stream(s, "glBufferSubData(GL_ARRAY_BUFFER, %d, %d, data);\n", get_buffer_offset(exporter, buffer->buffer), buffer->size);
+}
+
+void print_buffer(Stream * s, Exporter * exporter, Buffer * buffer) {
+    print_global(s, exporter, "unsigned buffer%d = 0;\n", buffer->buffer);
+    print_release(exporter, "glDeleteBuffers(1, &buffer%d);\n", buffer->buffer);
+    print_stream(s, "glGenBuffers(1, &buffer%d);\n", buffer->buffer);
+    print_stream(s, "glBindBuffer(GL_ARRAY_BUFFER, buffer%d);\n", buffer->buffer);
+    print_stream(s, "glBufferData(GL_ARRAY_BUFFER, %d, data, %s);\n", buffer->size, buffer->dynamic ? "GL_DYNAMIC_DRAW" : "GL_STATIC_DRAW");
+}
+
+void print_ring_buffer(Stream * s, Exporter * exporter, Buffer * buffer, int ring_stride) {
+    const char * flags = "GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT";
+    print_global(s, exporter, "unsigned buffer%d = 0;\n", buffer->buffer);
+    print_release(exporter, "glDeleteBuffers(1, &buffer%d);\n", buffer->buffer);
+    print_stream(s, "glGenBuffers(1, &buffer%d);\n", buffer->buffer);
+    print_stream(s, "glBindBuffer(GL_ARRAY_BUFFER, buffer%d);\n", buffer->buffer);
+    print_stream(s, "glBufferStorage(GL_ARRAY_BUFFER, %d, NULL, %s);\n", ring_stride * RING_SIZE, flags);
+    print_handle(s, exporter, "char *", "buffer%d_map", buffer->buffer);
+    print_stream(s, "(char *)glMapBufferRange(GL_ARRAY_BUFFER, 0, %d, %s);\n", ring_stride * RING_SIZE, flags);
+    for (int i = 0; i < RING_SIZE; ++i) {
+        print_stream(s, "memcpy(buffer%d_map + %d, data, %d);\n", buffer->buffer, ring_stride * i, buffer->size);
+    }
+}
+
+void print_ring_begin(Stream * s, Exporter * exporter, Context * ctx) {
+    print_stream(s, "if (buffer_fence[buffer_ring]) {\n");
+    print_stream(s, "    while (glClientWaitSync(buffer_fence[buffer_ring], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED) {}\n");
+    print_stream(s, "    glDeleteSync(buffer_fence[buffer_ring]);\n");
+    print_stream(s, "    buffer_fence[buffer_ring] = NULL;\n");
+    print_stream(s, "}\n");
+
+    GCHeader * it = ctx->gc_next;
+    while (it != (GCHeader *)ctx) {
+        if (Py_TYPE(it) == ctx->module_state->Buffer_type) {
+            Buffer * buffer = (Buffer *)it;
+            int ring_stride = get_ring_stride(exporter, buffer->buffer);
+            if (ring_stride >= 0) {
+                print_stream(s, "memcpy(buffer%d_map + buffer_ring * %d, data, %d);\n", buffer->buffer, ring_stride, buffer->size);
+            }
+        }
+        it = it->gc_next;
+    }
+}
+
+void print_ring_end(Stream * s) {
+    print_stream(s, "buffer_fence[buffer_ring] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);\n");
+    print_stream(s, "buffer_ring = (buffer_ring + 1) %% %d;\n", RING_SIZE);
 }
 
-void print_image(char *& s, Image * image) {
+void print_image(Stream * s, Exporter * exporter, Image * image) {
     if (image->renderbuffer) {
-        s += sprintf(s, "unsigned renderbuffer%d = 0;\n", image->image);
-        s += sprintf(s, "glGenRenderbuffers(1, &renderbuffer%d);\n", image->image);
-        s += sprintf(s, "glBindRenderbuffer(GL_RENDERBUFFER, renderbuffer%d);\n", image->image);
-        s += sprintf(s, "glRenderbufferStorageMultisample(GL_RENDERBUFFER, %d, %s, %d, %d);\n", image->samples > 1 ? image->samples : 0, str_internal_format(image->format.internal_format), image->width, image->height);
+        print_global(s, exporter, "unsigned renderbuffer%d = 0;\n", image->image);
+        print_release(exporter, "glDeleteRenderbuffers(1, &renderbuffer%d);\n", image->image);
+        print_stream(s, "glGenRenderbuffers(1, &renderbuffer%d);\n", image->image);
+        print_stream(s, "glBindRenderbuffer(GL_RENDERBUFFER, renderbuffer%d);\n", image->image);
+        print_stream(s, "glRenderbufferStorageMultisample(GL_RENDERBUFFER, %d, %s, %d, %d);\n", image->samples > 1 ? image->samples : 0, str_internal_format(image->format.internal_format), image->width, image->height);
     } else {
-        s += sprintf(s, "unsigned image%d = 0;\n", image->image);
-        s += sprintf(s, "glGenTextures(1, &image%d);\n", image->image);
-        s += sprintf(s, "glBindTexture(%s, image%d);\n", str_texture_target(image->target), image->image);
+        print_global(s, exporter, "unsigned image%d = 0;\n", image->image);
+        print_release(exporter, "glDeleteTextures(1, &image%d);\n", image->image);
+        print_stream(s, "glGenTextures(1, &image%d);\n", image->image);
+        print_stream(s, "glBindTexture(%s, image%d);\n", str_texture_target(image->target), image->image);
         if (image->cubemap) {
             for (int i = 0; i < 6; ++i) {
-                s += sprintf(s, "glTexImage2D(%s, 0, %s, %d, %d, 0, %s, %s, data);\n", str_cubemap_face(i), str_internal_format(image->format.internal_format), image->width, image->height, str_pixel_format(image->format.format), str_format(image->format.type));
+                print_stream(s, "glTexImage2D(%s, 0, %s, %d, %d, 0, %s, %s, data);\n", str_cubemap_face(i), str_internal_format(image->format.internal_format), image->width, image->height, str_pixel_format(image->format.format), str_format(image->format.type));
             }
         } else if (image->array) {
-            s += sprintf(s, "glTexImage3D(%s, 0, %s, %d, %d, %d, 0, %s, %s, data);\n", str_texture_target(image->target), str_internal_format(image->format.internal_format), image->width, image->height, image->array, str_pixel_format(image->format.format), str_format(image->format.type));
+            print_stream(s, "glTexImage3D(%s, 0, %s, %d, %d, %d, 0, %s, %s, data);\n", str_texture_target(image->target), str_internal_format(image->format.internal_format), image->width, image->height, image->array, str_pixel_format(image->format.format), str_format(image->format.type));
         } else {
-            s += sprintf(s, "glTexImage2D(%s, 0, %s, %d, %d, 0, %s, %s, data);\n", str_texture_target(image->target), str_internal_format(image->format.internal_format), image->width, image->height, str_pixel_format(image->format.format), str_format(image->format.type));
+            print_stream(s, "glTexImage2D(%s, 0, %s, %d, %d, 0, %s, %s, data);\n", str_texture_target(image->target), str_internal_format(image->format.internal_format), image->width, image->height, str_pixel_format(image->format.format), str_format(image->format.type));
         }
     }
 }
 
-void print_framebuffer_attachment(char *& s, ImageFace * face, int idx) {
+void print_texture_array(Stream * s, Exporter * exporter, int texture_array, PyObject * images) {
+    int layers = (int)PyList_Size(images);
+    Image * first = (Image *)PyList_GetItem(images, 0);
+    const char * internal_format = str_internal_format(first->format.internal_format);
+    const char * pixel_format = str_pixel_format(first->format.format);
+    const char * type = str_format(first->format.type);
+
+    print_global(s, exporter, "unsigned texture_array%d = 0;\n", texture_array);
+    print_release(exporter, "glDeleteTextures(1, &texture_array%d);\n", texture_array);
+    print_stream(s, "glGenTextures(1, &texture_array%d);\n", texture_array);
+    print_stream(s, "glBindTexture(GL_TEXTURE_2D_ARRAY, texture_array%d);\n", texture_array);
+    print_stream(s, "glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, %s, %d, %d, %d, 0, %s, %s, NULL);\n", internal_format, first->width, first->height, layers, pixel_format, type);
+    for (int i = 0; i < layers; ++i) {
+        print_stream(s, "glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, %d, %d, %d, 1, %s, %s, data);\n", i, first->width, first->height, pixel_format, type);
+    }
+    for (int i = 0; i < layers; ++i) {
+        print_global(s, exporter, "const int image%d_layer = %d;\n", ((Image *)PyList_GetItem(images, i))->image, i);
+    }
+}
+
+void print_framebuffer_attachment(Stream * s, ImageFace * face, int idx) {
     char color_attachment[32];
-    const char * attachment = face->image->format.buffer == 0x1801 ? "GL_DEPTH_ATTACHMENT" : face->image->format.buffer == 0x1802 ? "GL_STENCIL_ATTACHMENT" : "GL_DEPTH_STENCIL_ATTACHMENT";
+    const char * attachment = str_depth_stencil_attachment(face->image->format.buffer);
     if (idx >= 0) {
         sprintf(color_attachment, "GL_COLOR_ATTACHMENT%d", idx);
         attachment = color_attachment;
     }
     if (face->image->renderbuffer) {
-        s += sprintf(s, "glFramebufferRenderbuffer(GL_FRAMEBUFFER, %s, GL_RENDERBUFFER, renderbuffer%d);\n", attachment, face->image->image);
+        print_stream(s, "glFramebufferRenderbuffer(GL_FRAMEBUFFER, %s, GL_RENDERBUFFER, renderbuffer%d);\n", attachment, face->image->image);
     } else if (face->image->cubemap) {
-        s += sprintf(s, "glFramebufferTexture2D(GL_FRAMEBUFFER, %s, %s, image%d, %d);\n", attachment, str_cubemap_face(face->layer), face->image->image, face->level);
+        print_stream(s, "glFramebufferTexture2D(GL_FRAMEBUFFER, %s, %s, image%d, %d);\n", attachment, str_cubemap_face(face->layer), face->image->image, face->level);
     } else if (face->image->array) {
-        s += sprintf(s, "glFramebufferTextureLayer(GL_FRAMEBUFFER, %s, image%d, %d, %d);\n", attachment, face->image->image, face->level, face->layer);
+        print_stream(s, "glFramebufferTextureLayer(GL_FRAMEBUFFER, %s, image%d, %d, %d);\n", attachment, face->image->image, face->level, face->layer);
     } else {
-        s += sprintf(s, "glFramebufferTexture2D(GL_FRAMEBUFFER, %s, GL_TEXTURE_2D, image%d, %d);\n", attachment, face->image->image, face->level);
+        print_stream(s, "glFramebufferTexture2D(GL_FRAMEBUFFER, %s, GL_TEXTURE_2D, image%d, %d);\n", attachment, face->image->image, face->level);
     }
 }
 
-void print_framebuffer(char *& s, int framebuffer, PyObject * attachments) {
+void print_framebuffer(Stream * s, Exporter * exporter, int framebuffer, PyObject * attachments) {
     PyObject * color_attachments = PyTuple_GetItem(attachments, 1);
     PyObject * depth_stencil_attachment = PyTuple_GetItem(attachments, 2);
     int color_attachment_count = (int)PyTuple_Size(color_attachments);
 
-    s += sprintf(s, "unsigned framebuffer%d = 0;\n", framebuffer);
-    s += sprintf(s, "glGenFramebuffers(1, &framebuffer%d);\n", framebuffer);
-    s += sprintf(s, "glBindFramebuffer(GL_FRAMEBUFFER, framebuffer%d);\n", framebuffer);
+    print_global(s, exporter, "unsigned framebuffer%d = 0;\n", framebuffer);
+    print_release(exporter, "glDeleteFramebuffers(1, &framebuffer%d);\n", framebuffer);
+    print_stream(s, "glGenFramebuffers(1, &framebuffer%d);\n", framebuffer);
+    print_stream(s, "glBindFramebuffer(GL_FRAMEBUFFER, framebuffer%d);\n", framebuffer);
 
     for (int i = 0; i < color_attachment_count; ++i) {
         ImageFace * face = (ImageFace *)PyTuple_GetItem(color_attachments, i);
@@ -577,38 +844,42 @@ void print_framebuffer(char *& s, int framebuffer, PyObject * attachments) {
         print_framebuffer_attachment(s, face, -1);
     }
 
-    s += sprintf(s, "unsigned draw_buffers%d[] = {", framebuffer);
+    print_global(s, exporter, "unsigned draw_buffers%d[] = {", framebuffer);
     for (int i = 0; i < color_attachment_count; ++i) {
-        s += sprintf(s, "%sGL_COLOR_ATTACHMENT%d", i ? ", " : "", i);
+        print_global(s, exporter, "%sGL_COLOR_ATTACHMENT%d", i ? ", " : "", i);
     }
-    s += sprintf(s, "};\n");
+    print_global(s, exporter, "};\n");
 
-    s += sprintf(s, "glDrawBuffers(%d, draw_buffers%d);\n", color_attachment_count, framebuffer);
-    s += sprintf(s, "glReadBuffer(%s);\n", color_attachment_count ? "GL_COLOR_ATTACHMENT0" : "GL_NONE");
+    print_stream(s, "glDrawBuffers(%d, draw_buffers%d);\n", color_attachment_count, framebuffer);
+    print_stream(s, "glReadBuffer(%s);\n", color_attachment_count ? "GL_COLOR_ATTACHMENT0" : "GL_NONE");
 }
 
-void print_shader(char *& s, PyObject * src, int shader, int type) {
-    s += sprintf(s, "const char * src%d = %s;\n", shader, PyUnicode_AsUTF8(src));
-    s += sprintf(s, "unsigned shader%d = glCreateShader(%s);\n", shader, str_shader_type(type));
-    s += sprintf(s, "glShaderSource(shader%d, 1, &src%d, NULL);\n", shader, shader);
-    s += sprintf(s, "glCompileShader(shader%d);\n", shader);
+void print_shader(Stream * s, Exporter * exporter, PyObject * src, int shader, int type) {
+    print_global(s, exporter, "const char * src%d = %s;\n", shader, PyUnicode_AsUTF8(src));
+    print_handle(s, exporter, "unsigned", "shader%d", shader);
+    print_release(exporter, "glDeleteShader(shader%d);\n", shader);
+    print_stream(s, "glCreateShader(%s);\n", str_shader_type(type));
+    print_stream(s, "glShaderSource(shader%d, 1, &src%d, NULL);\n", shader, shader);
+    print_stream(s, "glCompileShader(shader%d);\n", shader);
 }
 
-void print_program(char *& s, int program, int vertex_shader, int fragment_shader) {
-    s += sprintf(s, "unsigned program%d = glCreateProgram();\n", program);
-    s += sprintf(s, "glAttachShader(program%d, shader%d);\n", program, vertex_shader);
-    s += sprintf(s, "glAttachShader(program%d, shader%d);\n", program, fragment_shader);
-    s += sprintf(s, "glLinkProgram(program%d);\n", program);
+void print_program(Stream * s, Exporter * exporter, int program, int vertex_shader, int fragment_shader) {
+    print_handle(s, exporter, "unsigned", "program%d", program);
+    print_release(exporter, "glDeleteProgram(program%d);\n", program);
+    print_stream(s, "glCreateProgram();\n");
+    print_stream(s, "glAttachShader(program%d, shader%d);\n", program, vertex_shader);
+    print_stream(s, "glAttachShader(program%d, shader%d);\n", program, fragment_shader);
+    print_stream(s, "glLinkProgram(program%d);\n", program);
 }
 
-void print_vertex_array(char *& s, int vertex_array, PyObject * bindings) {
+void print_texture_layers_location(Stream * s, Exporter * exporter, int program) {
+    print_handle(s, exporter, "int", "program%d_texture_layers", program);
+    print_stream(s, "glGetUniformLocation(program%d, \"texture_layers\");\n", program);
+}
+
+void print_vertex_attributes(Stream * s, Exporter * exporter, PyObject * bindings, bool ring_only) {
     int length = (int)PyTuple_Size(bindings);
     PyObject ** seq = PySequence_Fast_ITEMS(bindings);
-    PyObject * index_buffer = seq[0];
-
-    s += sprintf(s, "unsigned vertex_array%d = 0;\n", vertex_array);
-    s += sprintf(s, "glGenVertexArrays(1, &vertex_array%d);\n", vertex_array);
-    s += sprintf(s, "glBindVertexArray(vertex_array%d);\n", vertex_array);
 
     for (int i = 1; i < length; i += 6) {
         Buffer * buffer = (Buffer *)seq[i + 0];
@@ -617,232 +888,2277 @@ void print_vertex_array(char *& s, int vertex_array, PyObject * bindings) {
         int stride = PyLong_AsLong(seq[i + 3]);
         int divisor = PyLong_AsLong(seq[i + 4]);
         VertexFormat format = get_vertex_format(PyUnicode_AsUTF8(seq[i + 5]));
-        s += sprintf(s, "glBindBuffer(GL_ARRAY_BUFFER, buffer%d);\n", buffer->buffer);
+        if (ring_only && get_ring_stride(exporter, buffer->buffer) < 0) {
+            continue;
+        }
+        BufferRef ref = get_buffer_ref(exporter, buffer->buffer, offset);
+        print_stream(s, "glBindBuffer(GL_ARRAY_BUFFER, %s);\n", ref.name);
+        if (format.integer) {
+            print_stream(s, "glVertexAttribIPointer(%d, %d, %s, %d, %s);\n", location, format.size, str_format(format.type), stride, ref.offset);
+        } else {
+            print_stream(s, "glVertexAttribPointer(%d, %d, %s, %s, %d, %s);\n", location, format.size, str_format(format.type), format.normalize ? "true" : "false", stride, ref.offset);
+        }
+        if (!ring_only) {
+            print_stream(s, "glVertexAttribDivisor(%d, %d);\n", location, divisor);
+            print_stream(s, "glEnableVertexAttribArray(%d);\n", location);
+        }
+    }
+}
+
+void print_vertex_array(Stream * s, Exporter * exporter, int vertex_array, PyObject * bindings) {
+    PyObject * index_buffer = PyTuple_GetItem(bindings, 0);
+
+    print_global(s, exporter, "unsigned vertex_array%d = 0;\n", vertex_array);
+    print_release(exporter, "glDeleteVertexArrays(1, &vertex_array%d);\n", vertex_array);
+    print_stream(s, "glGenVertexArrays(1, &vertex_array%d);\n", vertex_array);
+    print_stream(s, "glBindVertexArray(vertex_array%d);\n", vertex_array);
+
+    print_vertex_attributes(s, exporter, bindings, false);
+
+    if (index_buffer != Py_None) {
+        Buffer * buffer = (Buffer *)index_buffer;
+        print_stream(s, "glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, %s);\n", get_buffer_ref(exporter, buffer->buffer, 0).name);
+    }
+}
+
+bool uses_ring_buffers(Exporter * exporter, PyObject * bindings) {
+    int length = (int)PyTuple_Size(bindings);
+    PyObject ** seq = PySequence_Fast_ITEMS(bindings);
+    for (int i = 1; i < length; i += 6) {
+        if (get_ring_stride(exporter, ((Buffer *)seq[i])->buffer) >= 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void print_vertex_array_ring_offsets(Stream * s, Exporter * exporter) {
+    PyObject * key;
+    PyObject * value;
+    Py_ssize_t pos = 0;
+    while (PyDict_Next(exporter->vertex_arrays, &pos, &key, &value)) {
+        PyObject * bindings = PyTuple_GetItem(value, 1);
+        if (uses_ring_buffers(exporter, bindings)) {
+            print_stream(s, "glBindVertexArray(vertex_array%d);\n", (int)PyLong_AsLong(key));
+            print_vertex_attributes(s, exporter, bindings, true);
+        }
+    }
+}
+
+struct VertexBinding {
+    Buffer * buffer;
+    int offset;
+    int stride;
+    int divisor;
+};
+
+int get_vertex_bindings(PyObject * bindings, VertexBinding * vertex_bindings, int * attribute_bindings) {
+    int length = (int)PyTuple_Size(bindings);
+    PyObject ** seq = PySequence_Fast_ITEMS(bindings);
+    int count = 0;
+
+    for (int i = 1; i < length; i += 6) {
+        Buffer * buffer = (Buffer *)seq[i + 0];
+        int offset = PyLong_AsLong(seq[i + 2]);
+        int stride = PyLong_AsLong(seq[i + 3]);
+        int divisor = PyLong_AsLong(seq[i + 4]);
+        int binding = 0;
+        while (binding < count) {
+            VertexBinding * it = &vertex_bindings[binding];
+            int relative_offset = offset - it->offset;
+            bool interleaved = relative_offset >= 0 && relative_offset <= MAX_VERTEX_ATTRIB_RELATIVE_OFFSET && (!stride || relative_offset < stride);
+            if (it->buffer == buffer && it->stride == stride && it->divisor == divisor && interleaved) {
+                break;
+            }
+            binding += 1;
+        }
+        if (binding == count) {
+            vertex_bindings[count++] = {buffer, offset, stride, divisor};
+        }
+        attribute_bindings[i / 6] = binding;
+    }
+
+    return count;
+}
+
+PyObject * vertex_layout_key(PyObject * bindings) {
+    int length = (int)PyTuple_Size(bindings);
+    PyObject ** seq = PySequence_Fast_ITEMS(bindings);
+    if (length / 6 > MAX_VERTEX_ATTRIBUTES) {
+        PyErr_Format(PyExc_ValueError, "too many vertex attributes");
+        return NULL;
+    }
+
+    VertexBinding vertex_bindings[MAX_VERTEX_ATTRIBUTES];
+    int attribute_bindings[MAX_VERTEX_ATTRIBUTES];
+    get_vertex_bindings(bindings, vertex_bindings, attribute_bindings);
+
+    PyObject * res = PyTuple_New(length / 6);
+    if (!res) {
+        return NULL;
+    }
+
+    for (int i = 1; i < length; i += 6) {
+        int binding = attribute_bindings[i / 6];
+        int relative_offset = PyLong_AsLong(seq[i + 2]) - vertex_bindings[binding].offset;
+        PyObject * attribute = Py_BuildValue("(OOiiOO)", seq[i + 1], seq[i + 5], binding, relative_offset, seq[i + 3], seq[i + 4]);
+        if (!attribute) {
+            Py_DECREF(res);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(res, i / 6, attribute);
+    }
+
+    return res;
+}
+
+void print_vertex_layout(Stream * s, Exporter * exporter, int vertex_layout, PyObject * bindings) {
+    int length = (int)PyTuple_Size(bindings);
+    PyObject ** seq = PySequence_Fast_ITEMS(bindings);
+    VertexBinding vertex_bindings[MAX_VERTEX_ATTRIBUTES];
+    int attribute_bindings[MAX_VERTEX_ATTRIBUTES];
+    int binding_count = get_vertex_bindings(bindings, vertex_bindings, attribute_bindings);
+
+    print_global(s, exporter, "unsigned vertex_layout%d = 0;\n", vertex_layout);
+    print_release(exporter, "glDeleteVertexArrays(1, &vertex_layout%d);\n", vertex_layout);
+    print_stream(s, "glGenVertexArrays(1, &vertex_layout%d);\n", vertex_layout);
+    print_stream(s, "glBindVertexArray(vertex_layout%d);\n", vertex_layout);
+
+    for (int i = 1; i < length; i += 6) {
+        int location = PyLong_AsLong(seq[i + 1]);
+        int binding = attribute_bindings[i / 6];
+        int relative_offset = PyLong_AsLong(seq[i + 2]) - vertex_bindings[binding].offset;
+        VertexFormat format = get_vertex_format(PyUnicode_AsUTF8(seq[i + 5]));
         if (format.integer) {
-            s += sprintf(s, "glVertexAttribIPointer(%d, %d, %s, %d, %d);\n", location, format.size, str_format(format.type), stride, offset);
+            print_stream(s, "glVertexAttribIFormat(%d, %d, %s, %d);\n", location, format.size, str_format(format.type), relative_offset);
         } else {
-            s += sprintf(s, "glVertexAttribPointer(%d, %d, %s, %s, %d, %d);\n", location, format.size, str_format(format.type), format.normalize ? "true" : "false", stride, offset);
+            print_stream(s, "glVertexAttribFormat(%d, %d, %s, %s, %d);\n", location, format.size, str_format(format.type), format.normalize ? "true" : "false", relative_offset);
         }
-        s += sprintf(s, "glVertexAttribDivisor(%d, %d);\n", location, divisor);
-        s += sprintf(s, "glEnableVertexAttribArray(%d);\n", location);
+        print_stream(s, "glVertexAttribBinding(%d, %d);\n", location, binding);
+        print_stream(s, "glEnableVertexAttribArray(%d);\n", location);
+    }
+
+    for (int i = 0; i < binding_count; ++i) {
+        print_stream(s, "glVertexBindingDivisor(%d, %d);\n", i, vertex_bindings[i].divisor);
+    }
+}
+
+void print_vertex_buffers(Stream * s, Exporter * exporter, PyObject * bindings) {
+    PyObject * index_buffer = PyTuple_GetItem(bindings, 0);
+    VertexBinding vertex_bindings[MAX_VERTEX_ATTRIBUTES];
+    int attribute_bindings[MAX_VERTEX_ATTRIBUTES];
+    int binding_count = get_vertex_bindings(bindings, vertex_bindings, attribute_bindings);
+
+    for (int i = 0; i < binding_count; ++i) {
+        BufferRef ref = get_buffer_ref(exporter, vertex_bindings[i].buffer->buffer, vertex_bindings[i].offset);
+        print_stream(s, "glBindVertexBuffer(%d, %s, %s, %d);\n", i, ref.name, ref.offset, vertex_bindings[i].stride);
     }
 
     if (index_buffer != Py_None) {
         Buffer * buffer = (Buffer *)index_buffer;
-        s += sprintf(s, "glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer%d);\n", buffer->buffer);
+        print_stream(s, "glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, %s);\n", get_buffer_ref(exporter, buffer->buffer, 0).name);
     }
 }
 
-void print_sampler(char *& s, int sampler, PyObject * params) {
+void print_sampler(Stream * s, Exporter * exporter, int sampler, PyObject * params) {
     PyObject ** seq = PySequence_Fast_ITEMS(params);
 
-    s += sprintf(s, "unsigned sampler%d = 0;\n", sampler);
-    s += sprintf(s, "glGenSamplers(1, &sampler%d);\n", sampler);
-    s += sprintf(s, "glSamplerParameteri(sampler%d, GL_TEXTURE_MIN_FILTER, %s);\n", sampler, str_filter(PyLong_AsLong(seq[0])));
-    s += sprintf(s, "glSamplerParameteri(sampler%d, GL_TEXTURE_MAG_FILTER, %s);\n", sampler, str_filter(PyLong_AsLong(seq[1])));
-    s += sprintf(s, "glSamplerParameterf(sampler%d, GL_TEXTURE_MIN_LOD, %f);\n", sampler, PyFloat_AsDouble(seq[2]));
-    s += sprintf(s, "glSamplerParameterf(sampler%d, GL_TEXTURE_MAX_LOD, %f);\n", sampler, PyFloat_AsDouble(seq[3]));
-    s += sprintf(s, "glSamplerParameterf(sampler%d, GL_TEXTURE_LOD_BIAS, %f);\n", sampler, PyFloat_AsDouble(seq[4]));
-    s += sprintf(s, "glSamplerParameteri(sampler%d, GL_TEXTURE_WRAP_S, %s);\n", sampler, str_texture_wrap(PyLong_AsLong(seq[5])));
-    s += sprintf(s, "glSamplerParameteri(sampler%d, GL_TEXTURE_WRAP_T, %s);\n", sampler, str_texture_wrap(PyLong_AsLong(seq[6])));
-    s += sprintf(s, "glSamplerParameteri(sampler%d, GL_TEXTURE_WRAP_R, %s);\n", sampler, str_texture_wrap(PyLong_AsLong(seq[7])));
-    s += sprintf(s, "glSamplerParameteri(sampler%d, GL_TEXTURE_COMPARE_MODE, %s);\n", sampler, str_compare_mode(PyLong_AsLong(seq[8])));
-    s += sprintf(s, "glSamplerParameteri(sampler%d, GL_TEXTURE_COMPARE_FUNC, %s);\n", sampler, str_compare_func(PyLong_AsLong(seq[9])));
-    s += sprintf(s, "glSamplerParameterf(sampler%d, GL_TEXTURE_MAX_ANISOTROPY, %f);\n", sampler, PyFloat_AsDouble(seq[10]));
+    print_global(s, exporter, "unsigned sampler%d = 0;\n", sampler);
+    print_release(exporter, "glDeleteSamplers(1, &sampler%d);\n", sampler);
+    print_stream(s, "glGenSamplers(1, &sampler%d);\n", sampler);
+    print_stream(s, "glSamplerParameteri(sampler%d, GL_TEXTURE_MIN_FILTER, %s);\n", sampler, str_filter(PyLong_AsLong(seq[0])));
+    print_stream(s, "glSamplerParameteri(sampler%d, GL_TEXTURE_MAG_FILTER, %s);\n", sampler, str_filter(PyLong_AsLong(seq[1])));
+    print_stream(s, "glSamplerParameterf(sampler%d, GL_TEXTURE_MIN_LOD, %f);\n", sampler, PyFloat_AsDouble(seq[2]));
+    print_stream(s, "glSamplerParameterf(sampler%d, GL_TEXTURE_MAX_LOD, %f);\n", sampler, PyFloat_AsDouble(seq[3]));
+    print_stream(s, "glSamplerParameterf(sampler%d, GL_TEXTURE_LOD_BIAS, %f);\n", sampler, PyFloat_AsDouble(seq[4]));
+    print_stream(s, "glSamplerParameteri(sampler%d, GL_TEXTURE_WRAP_S, %s);\n", sampler, str_texture_wrap(PyLong_AsLong(seq[5])));
+    print_stream(s, "glSamplerParameteri(sampler%d, GL_TEXTURE_WRAP_T, %s);\n", sampler, str_texture_wrap(PyLong_AsLong(seq[6])));
+    print_stream(s, "glSamplerParameteri(sampler%d, GL_TEXTURE_WRAP_R, %s);\n", sampler, str_texture_wrap(PyLong_AsLong(seq[7])));
+    print_stream(s, "glSamplerParameteri(sampler%d, GL_TEXTURE_COMPARE_MODE, %s);\n", sampler, str_compare_mode(PyLong_AsLong(seq[8])));
+    print_stream(s, "glSamplerParameteri(sampler%d, GL_TEXTURE_COMPARE_FUNC, %s);\n", sampler, str_compare_func(PyLong_AsLong(seq[9])));
+    print_stream(s, "glSamplerParameterf(sampler%d, GL_TEXTURE_MAX_ANISOTROPY, %f);\n", sampler, PyFloat_AsDouble(seq[10]));
 
     float r = (float)PyFloat_AsDouble(seq[11]);
     float g = (float)PyFloat_AsDouble(seq[12]);
     float b = (float)PyFloat_AsDouble(seq[13]);
     float a = (float)PyFloat_AsDouble(seq[14]);
 
-    s += sprintf(s, "float border%d[] = {%f, %f, %f, %f};\n", sampler, r, g, b, a);
-    s += sprintf(s, "glSamplerParameterfv(sampler%d, GL_TEXTURE_BORDER_COLOR, border%d);\n", sampler, sampler);
+    print_global(s, exporter, "float border%d[] = {%f, %f, %f, %f};\n", sampler, r, g, b, a);
+    print_stream(s, "glSamplerParameterfv(sampler%d, GL_TEXTURE_BORDER_COLOR, border%d);\n", sampler, sampler);
 }
 
-void print_settings(char *& s, GlobalSettings * settings) {
-    s += sprintf(s, "%s(GL_PRIMITIVE_RESTART);\n", settings->primitive_restart ? "glEnable" : "glDisable");
-    s += sprintf(s, "%s(GL_POLYGON_OFFSET_FILL);\n", settings->polygon_offset ? "glEnable" : "glDisable");
-    s += sprintf(s, "%s(GL_CULL_FACE);\n", settings->cull_face ? "glEnable" : "glDisable");
-    s += sprintf(s, "%s(GL_DEPTH_TEST);\n", settings->depth_test ? "glEnable" : "glDisable");
-    s += sprintf(s, "%s(GL_STENCIL_TEST);\n", settings->stencil_test ? "glEnable" : "glDisable");
+void print_settings(Stream * s, GlobalSettings * settings) {
+    print_stream(s, "%s(GL_PRIMITIVE_RESTART);\n", settings->primitive_restart ? "glEnable" : "glDisable");
+    print_stream(s, "%s(GL_POLYGON_OFFSET_FILL);\n", settings->polygon_offset ? "glEnable" : "glDisable");
+    print_stream(s, "%s(GL_CULL_FACE);\n", settings->cull_face ? "glEnable" : "glDisable");
+    print_stream(s, "%s(GL_DEPTH_TEST);\n", settings->depth_test ? "glEnable" : "glDisable");
+    print_stream(s, "%s(GL_STENCIL_TEST);\n", settings->stencil_test ? "glEnable" : "glDisable");
     if (settings->polygon_offset) {
-        s += sprintf(s, "glPolygonOffset(%f, %f);\n", settings->polygon_offset_factor, settings->polygon_offset_units);
+        print_stream(s, "glPolygonOffset(%f, %f);\n", settings->polygon_offset_factor, settings->polygon_offset_units);
     }
     if (settings->cull_face) {
-        s += sprintf(s, "glCullFace(%s);\n", str_cull_face(settings->cull_face));
+        print_stream(s, "glCullFace(%s);\n", str_cull_face(settings->cull_face));
     }
     if (settings->depth_test) {
-        s += sprintf(s, "glDepthFunc(%s);\n", str_compare_func(settings->depth_func));
-    }
-    s += sprintf(s, "glStencilMaskSeparate(GL_FRONT, 0x%02x);\n", settings->stencil_front.write_mask);
-    s += sprintf(s, "glStencilMaskSeparate(GL_BACK, 0x%02x);\n", settings->stencil_back.write_mask);
-    s += sprintf(s, "glStencilFuncSeparate(GL_FRONT, %s, 0x%02x, 0x%02x);\n", str_compare_func(settings->stencil_front.compare_op), settings->stencil_front.reference, settings->stencil_front.compare_mask);
-    s += sprintf(s, "glStencilFuncSeparate(GL_BACK, %s, 0x%02x, 0x%02x);\n", str_compare_func(settings->stencil_back.compare_op), settings->stencil_back.reference, settings->stencil_back.compare_mask);
-    s += sprintf(s, "glStencilOpSeparate(GL_FRONT, %s, %s, %s);\n", str_stencil_op(settings->stencil_front.fail_op), str_stencil_op(settings->stencil_front.pass_op), str_stencil_op(settings->stencil_front.depth_fail_op));
-    s += sprintf(s, "glStencilOpSeparate(GL_BACK, %s, %s, %s);\n", str_stencil_op(settings->stencil_back.fail_op), str_stencil_op(settings->stencil_back.pass_op), str_stencil_op(settings->stencil_back.depth_fail_op));
-    s += sprintf(s, "glDepthMask(%s);\n", settings->depth_write ? "true" : "false");
+        print_stream(s, "glDepthFunc(%s);\n", str_compare_func(settings->depth_func));
+    }
+    print_stream(s, "glStencilMaskSeparate(GL_FRONT, 0x%02x);\n", settings->stencil_front.write_mask);
+    print_stream(s, "glStencilMaskSeparate(GL_BACK, 0x%02x);\n", settings->stencil_back.write_mask);
+    print_stream(s, "glStencilFuncSeparate(GL_FRONT, %s, 0x%02x, 0x%02x);\n", str_compare_func(settings->stencil_front.compare_op), settings->stencil_front.reference, settings->stencil_front.compare_mask);
+    print_stream(s, "glStencilFuncSeparate(GL_BACK, %s, 0x%02x, 0x%02x);\n", str_compare_func(settings->stencil_back.compare_op), settings->stencil_back.reference, settings->stencil_back.compare_mask);
+    print_stream(s, "glStencilOpSeparate(GL_FRONT, %s, %s, %s);\n", str_stencil_op(settings->stencil_front.fail_op), str_stencil_op(settings->stencil_front.pass_op), str_stencil_op(settings->stencil_front.depth_fail_op));
+    print_stream(s, "glStencilOpSeparate(GL_BACK, %s, %s, %s);\n", str_stencil_op(settings->stencil_back.fail_op), str_stencil_op(settings->stencil_back.pass_op), str_stencil_op(settings->stencil_back.depth_fail_op));
+    print_stream(s, "glDepthMask(%s);\n", settings->depth_write ? "true" : "false");
     for (int i = 0; i < settings->attachments; ++i) {
         bool r = settings->color_mask >> (i * 4 + 0) & 1;
         bool g = settings->color_mask >> (i * 4 + 1) & 1;
         bool b = settings->color_mask >> (i * 4 + 2) & 1;
         bool a = settings->color_mask >> (i * 4 + 3) & 1;
-        s += sprintf(s, "glColorMaski(%d, %s, %s, %s, %s);\n", i, r ? "true" : "false", g ? "true" : "false", b ? "true" : "false", a ? "true" : "false");
+        print_stream(s, "glColorMaski(%d, %s, %s, %s, %s);\n", i, r ? "true" : "false", g ? "true" : "false", b ? "true" : "false", a ? "true" : "false");
     }
-    s += sprintf(s, "glBlendEquationSeparate(%s, %s);\n", str_blend_func(settings->blend_op_color), str_blend_func(settings->blend_op_alpha));
-    s += sprintf(s, "glBlendFuncSeparate(%s, %s, %s, %s);\n", str_blend_constant(settings->blend_src_color), str_blend_constant(settings->blend_dst_color), str_blend_constant(settings->blend_src_alpha), str_blend_constant(settings->blend_dst_alpha));
+    print_stream(s, "glBlendEquationSeparate(%s, %s);\n", str_blend_func(settings->blend_op_color), str_blend_func(settings->blend_op_alpha));
+    print_stream(s, "glBlendFuncSeparate(%s, %s, %s, %s);\n", str_blend_constant(settings->blend_src_color), str_blend_constant(settings->blend_dst_color), str_blend_constant(settings->blend_src_alpha), str_blend_constant(settings->blend_dst_alpha));
     for (int i = 0; i < settings->attachments; ++i) {
-        s += sprintf(s, "%s(GL_BLEND, %d);\n", (settings->blend_enable >> i & 1) ? "glEnablei" : "glDisablei", i);
+        print_stream(s, "%s(GL_BLEND, %d);\n", (settings->blend_enable >> i & 1) ? "glEnablei" : "glDisablei", i);
     }
 }
 
-void print_pipeline(char *& s, Pipeline * self) {
-    print_settings(s, self->global_settings);
-    s += sprintf(s, "glViewport(%d, %d, %d, %d);\n", self->viewport.x, self->viewport.y, self->viewport.width, self->viewport.height);
-    s += sprintf(s, "glBindFramebuffer(GL_FRAMEBUFFER, framebuffer%d);\n", self->framebuffer->obj);
-    s += sprintf(s, "glUseProgram(program%d);\n", self->program->obj);
-    s += sprintf(s, "glBindVertexArray(vertex_array%d);\n", self->vertex_array->obj);
+PyObject * get_vertex_array(Exporter * exporter, int vertex_array) {
+    PyObject * vertex_array_key = PyLong_FromLong(vertex_array);
+    PyObject * res = PyDict_GetItem(exporter->vertex_arrays, vertex_array_key);
+    Py_DECREF(vertex_array_key);
+    return res;
+}
 
-    for (int i = 0; i < self->descriptor_set_buffers->buffers; ++i) {
-        int buffer = self->descriptor_set_buffers->binding[i].buffer;
-        int offset = self->descriptor_set_buffers->binding[i].offset;
-        int size = self->descriptor_set_buffers->binding[i].size;
-        s += sprintf(s, "glBindBufferRange(GL_UNIFORM_BUFFER, %d, buffer%d, %d, %d);\n", i, buffer, offset, size);
-    }
+PyObject * get_texture_layer(Exporter * exporter, int image) {
+    PyObject * image_key = PyLong_FromLong(image);
+    PyObject * res = PyDict_GetItem(exporter->texture_layers, image_key);
+    Py_DECREF(image_key);
+    return res;
+}
+
+int get_texture_array(Exporter * exporter, int image) {
+    PyObject * texture_layer = get_texture_layer(exporter, image);
+    return texture_layer ? PyLong_AsLong(PyTuple_GetItem(texture_layer, 0)) : -1;
+}
 
+bool get_texture_layers(Exporter * exporter, Pipeline * self, int * texture_layers) {
+    bool merged = false;
     for (int i = 0; i < self->descriptor_set_images->samplers; ++i) {
-        s += sprintf(s, "glActiveTexture(GL_TEXTURE%d);\n", i);
-        s += sprintf(s, "glBindTexture(%s, image%d);\n", str_texture_target(self->descriptor_set_images->binding[i].target), self->descriptor_set_images->binding[i].image);
-        s += sprintf(s, "glBindSampler(%d, sampler%d);\n", i, self->descriptor_set_images->binding[i].sampler);
+        PyObject * texture_layer = exporter->texture_arrays ? get_texture_layer(exporter, self->descriptor_set_images->binding[i].image) : NULL;
+        texture_layers[i] = texture_layer ? PyLong_AsLong(PyTuple_GetItem(texture_layer, 1)) : 0;
+        merged = merged || texture_layer;
     }
+    return merged;
+}
 
-    if (self->index_type) {
-        s += sprintf(s, "glDrawElementsInstanced(%s, %d, %s, %d * %d, %d);\n", str_topology(self->topology), self->vertex_count, str_format(self->index_type), self->first_vertex, self->index_size, self->instance_count);
-    } else {
-        s += sprintf(s, "glDrawArraysInstanced(%s, %d, %d, %d);\n", str_topology(self->topology), self->first_vertex, self->vertex_count, self->instance_count);
+bool samples_texture_arrays(Exporter * exporter, Context * ctx, int program) {
+    int texture_layers[MAX_SAMPLER_BINDINGS];
+    GCHeader * it = ctx->gc_next;
+    while (it != (GCHeader *)ctx) {
+        if (Py_TYPE(it) == ctx->module_state->Pipeline_type && ((Pipeline *)it)->program->obj == program) {
+            if (get_texture_layers(exporter, (Pipeline *)it, texture_layers)) {
+                return true;
+            }
+        }
+        it = it->gc_next;
     }
+    return false;
 }
 
-void print_default_settings(char *& s) {
-    s += sprintf(s, "glPrimitiveRestartIndex(-1);\n");
-    s += sprintf(s, "glEnable(GL_PROGRAM_POINT_SIZE);\n");
-    s += sprintf(s, "glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);\n");
-    s += sprintf(s, "glEnable(GL_FRAMEBUFFER_SRGB);\n");
+PyObject * get_framebuffer_attachments(Exporter * exporter, int framebuffer) {
+    PyObject * framebuffer_key = PyLong_FromLong(framebuffer);
+    PyObject * attachments = PyDict_GetItem(exporter->framebuffers, framebuffer_key);
+    Py_DECREF(framebuffer_key);
+    return attachments;
 }
 
-void print_blit_framebuffer(char *& s) {
-    s += sprintf(s, "glDisable(GL_FRAMEBUFFER_SRGB);\n");
-    s += sprintf(s, "glColorMaski(0, true, true, true, true);\n");
-    s += sprintf(s, "glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);\n");
-    s += sprintf(s, "glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);\n");
-    s += sprintf(s, "glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);\n");
-    s += sprintf(s, "glEnable(GL_FRAMEBUFFER_SRGB);\n");
+PyObject * get_image_key(int renderbuffer, int image) {
+    return Py_BuildValue("(ii)", renderbuffer ? 1 : 0, image);
 }
 
-PyObject * meth_dumps(PyObject * self, Context * ctx) {
-    char * temp = (char *)malloc(1024 * 1024);
-    char * ptr = temp;
-    GCHeader * it;
-    PyObject * key;
-    GLObject * value;
-    Py_ssize_t pos;
+int mark_image_use(Exporter * exporter, int renderbuffer, int image, int sampled) {
+    PyObject * image_key = get_image_key(renderbuffer, image);
+    PyObject * uses = image_key ? PyDict_GetItem(exporter->image_uses, image_key) : NULL;
+    int first_use = uses ? PyLong_AsLong(PyTuple_GetItem(uses, 0)) : exporter->pipeline_index;
+    PyObject * value = image_key ? Py_BuildValue("(ii)", first_use, exporter->pipeline_index) : NULL;
+    if (!value || PyDict_SetItem(exporter->image_uses, image_key, value) < 0 || (sampled && PySet_Add(exporter->sampled_images, image_key) < 0)) {
+        Py_XDECREF(image_key);
+        Py_XDECREF(value);
+        return -1;
+    }
+    Py_DECREF(image_key);
+    Py_DECREF(value);
+    return 0;
+}
 
-    it = ctx->gc_next;
-    while (it != (GCHeader *)ctx) {
-        if (Py_TYPE(it) == ctx->module_state->Buffer_type) {
-            print_buffer(ptr, (Buffer *)it);
-            ptr += sprintf(ptr, "\n");
+int mark_pipeline_uses(Exporter * exporter, Pipeline * self) {
+    PyObject * attachments = get_framebuffer_attachments(exporter, self->framebuffer->obj);
+    if (attachments) {
+        PyObject * color_attachments = PyTuple_GetItem(attachments, 1);
+        PyObject * depth_stencil_attachment = PyTuple_GetItem(attachments, 2);
+        for (int i = 0; i < (int)PyTuple_Size(color_attachments); ++i) {
+            if (mark_image_use(exporter, ((ImageFace *)PyTuple_GetItem(color_attachments, i))->image->renderbuffer, ((ImageFace *)PyTuple_GetItem(color_attachments, i))->image->image, false) < 0) {
+                return -1;
+            }
+        }
+        if (depth_stencil_attachment != Py_None && mark_image_use(exporter, ((ImageFace *)depth_stencil_attachment)->image->renderbuffer, ((ImageFace *)depth_stencil_attachment)->image->image, false) < 0) {
+            return -1;
         }
-        it = it->gc_next;
     }
 
-    it = ctx->gc_next;
-    while (it != (GCHeader *)ctx) {
-        if (Py_TYPE(it) == ctx->module_state->Image_type) {
-            print_image(ptr, (Image *)it);
-            ptr += sprintf(ptr, "\n");
+    for (int i = 0; i < self->descriptor_set_images->samplers; ++i) {
+        if (mark_image_use(exporter, false, self->descriptor_set_images->binding[i].image, true) < 0) {
+            return -1;
         }
-        it = it->gc_next;
     }
+    return 0;
+}
 
-    pos = 0;
-    while (PyDict_Next(ctx->sampler_cache, &pos, &key, (PyObject **)&value)) {
-        print_sampler(ptr, value->obj, key);
-        ptr += sprintf(ptr, "\n");
+int is_transient_attachment(Exporter * exporter, ImageFace * face, bool first) {
+    if (face->image->samples <= 1 && face->image->format.color) {
+        return false;
     }
-
-    pos = 0;
-    while (PyDict_Next(ctx->framebuffer_cache, &pos, &key, (PyObject **)&value)) {
-        print_framebuffer(ptr, value->obj, key);
-        ptr += sprintf(ptr, "\n");
+    PyObject * image_key = get_image_key(face->image->renderbuffer, face->image->image);
+    if (!image_key) {
+        return -1;
     }
-
-    pos = 0;
-    while (PyDict_Next(ctx->vertex_array_cache, &pos, &key, (PyObject **)&value)) {
-        print_vertex_array(ptr, value->obj, key);
-        ptr += sprintf(ptr, "\n");
+    PyObject * uses = PyDict_GetItem(exporter->image_uses, image_key);
+    int sampled = PySet_Contains(exporter->sampled_images, image_key);
+    Py_DECREF(image_key);
+    if (sampled < 0) {
+        return -1;
     }
+    return uses && !sampled && PyLong_AsLong(PyTuple_GetItem(uses, first ? 0 : 1)) == exporter->pipeline_index;
+}
 
-    pos = 0;
-    while (PyDict_Next(ctx->shader_cache, &pos, &key, (PyObject **)&value)) {
-        PyObject * decoded = PyObject_CallMethod(PyTuple_GetItem(key, 0), "decode", NULL);
-        if (!decoded) {
-            return NULL;
-        }
-        PyObject * compact = PyObject_CallMethod(regex, "sub", "(ssNiO)", "\\s*\\n\\s*", "\n", decoded, 0, PyObject_GetAttrString(regex, "M"));
-        if (!compact) {
-            return NULL;
+int get_invalidate_attachments(Exporter * exporter, PyObject * attachments, char names[][32]) {
+    PyObject * color_attachments = PyTuple_GetItem(attachments, 1);
+    PyObject * depth_stencil_attachment = PyTuple_GetItem(attachments, 2);
+    int color_attachment_count = (int)PyTuple_Size(color_attachments);
+    int count = 0;
+
+    for (int i = 0; i < color_attachment_count; ++i) {
+        int transient = is_transient_attachment(exporter, (ImageFace *)PyTuple_GetItem(color_attachments, i), false);
+        if (transient < 0) {
+            return -1;
         }
-        PyObject * src = PyObject_CallMethod(json, "dumps", "(N)", compact);
-        if (!src) {
-            return NULL;
+        if (transient) {
+            sprintf(names[count++], "GL_COLOR_ATTACHMENT%d", i);
         }
-        print_shader(ptr, src, value->obj, PyLong_AsLong(PyTuple_GetItem(key, 1)));
-        Py_DECREF(src);
-        ptr += sprintf(ptr, "\n");
     }
 
-    pos = 0;
-    while (PyDict_Next(ctx->program_cache, &pos, &key, (PyObject **)&value)) {
-        int vertex_shader = ((GLObject *)PyDict_GetItem(ctx->shader_cache, PyTuple_GetItem(key, 0)))->obj;
-        int fragment_shader = ((GLObject *)PyDict_GetItem(ctx->shader_cache, PyTuple_GetItem(key, 1)))->obj;
-        print_program(ptr, value->obj, vertex_shader, fragment_shader);
-        ptr += sprintf(ptr, "\n");
+    if (depth_stencil_attachment != Py_None) {
+        int transient = is_transient_attachment(exporter, (ImageFace *)depth_stencil_attachment, false);
+        if (transient < 0) {
+            return -1;
+        }
+        if (transient) {
+            sprintf(names[count++], "%s", str_depth_stencil_attachment(((ImageFace *)depth_stencil_attachment)->image->format.buffer));
+        }
     }
 
-    print_default_settings(ptr);
-    ptr += sprintf(ptr, "\n");
+    return count;
+}
 
-    it = ctx->gc_next;
-    while (it != (GCHeader *)ctx) {
-        if (Py_TYPE(it) == ctx->module_state->Pipeline_type) {
-            print_pipeline(ptr, (Pipeline *)it);
-            ptr += sprintf(ptr, "\n");
-        }
-        it = it->gc_next;
+int print_invalidate_framebuffer(Stream * s, Exporter * exporter, const char * target, PyObject * attachments) {
+    char names[MAX_ATTACHMENTS + 1][32];
+    int count = get_invalidate_attachments(exporter, attachments, names);
+
+    if (count <= 0) {
+        return count;
     }
 
-    print_blit_framebuffer(ptr);
-    PyObject * res = PyUnicode_FromStringAndSize(temp, ptr - temp);
-    free(temp);
-    return res;
+    int invalidate = exporter->invalidate_count++;
+    print_stream(s, "unsigned invalidate%d[] = {", invalidate);
+    for (int i = 0; i < count; ++i) {
+        print_stream(s, "%s%s", i ? ", " : "", names[i]);
+    }
+    print_stream(s, "};\n");
+    print_stream(s, "glInvalidateFramebuffer(%s, %d, invalidate%d);\n", target, count, invalidate);
+    return 0;
 }
 
-PyMethodDef module_methods[] = {
-    {"dumps", (PyCFunction)meth_dumps, METH_O, NULL},
-    {},
-};
+void print_clear_attachment(Stream * s, Exporter * exporter, ImageFace * face, int idx) {
+    Image * image = face->image;
+    const char * name = image->renderbuffer ? "renderbuffer" : "image";
+    const char * buffer = str_clear_buffer(image->format.buffer);
+    int drawbuffer = idx >= 0 ? idx : 0;
 
-PyModuleDef module_def = {PyModuleDef_HEAD_INIT, "zengl_export", NULL, -1, module_methods};
+    if (image->format.color) {
+        print_stream(s, "glColorMaski(%d, true, true, true, true);\n", idx);
+    } else {
+        print_stream(s, "glDepthMask(true);\n");
+        print_stream(s, "glStencilMask(0xff);\n");
+    }
 
-extern "C" PyObject * PyInit_zengl_export() {
-    json = PyImport_ImportModule("json");
-    if (!json) {
-        return NULL;
+    if (image->format.clear_type == 'f') {
+        const float * value = image->clear_value.clear_floats;
+        print_global(s, exporter, "float %s%d_clear[] = {%f, %f, %f, %f};\n", name, image->image, value[0], value[1], value[2], value[3]);
+        print_stream(s, "glClearBufferfv(%s, %d, %s%d_clear);\n", buffer, drawbuffer, name, image->image);
+    } else if (image->format.clear_type == 'i') {
+        const int * value = image->clear_value.clear_ints;
+        print_global(s, exporter, "int %s%d_clear[] = {%d, %d, %d, %d};\n", name, image->image, value[0], value[1], value[2], value[3]);
+        print_stream(s, "glClearBufferiv(%s, %d, %s%d_clear);\n", buffer, drawbuffer, name, image->image);
+    } else if (image->format.clear_type == 'u') {
+        const unsigned * value = image->clear_value.clear_uints;
+        print_global(s, exporter, "unsigned %s%d_clear[] = {%u, %u, %u, %u};\n", name, image->image, value[0], value[1], value[2], value[3]);
+        print_stream(s, "glClearBufferuiv(%s, %d, %s%d_clear);\n", buffer, drawbuffer, name, image->image);
+    } else if (image->format.clear_type == 'x') {
+        print_stream(s, "glClearBufferfi(%s, 0, %f, %d);\n", buffer, image->clear_value.clear_floats[0], image->clear_value.clear_ints[1]);
     }
-    regex = PyImport_ImportModule("re");
-    if (!regex) {
-        return NULL;
+}
+
+int print_clear_attachments(Stream * s, Exporter * exporter, Pipeline * self) {
+    PyObject * attachments = exporter->invalidate_framebuffers ? get_framebuffer_attachments(exporter, self->framebuffer->obj) : NULL;
+    if (!attachments) {
+        return 0;
     }
-    PyObject * module = PyModule_Create(&module_def);
-    return module;
+
+    PyObject * color_attachments = PyTuple_GetItem(attachments, 1);
+    PyObject * depth_stencil_attachment = PyTuple_GetItem(attachments, 2);
+    int color_attachment_count = (int)PyTuple_Size(color_attachments);
+    bool bound = false;
+
+    for (int i = 0; i <= color_attachment_count; ++i) {
+        PyObject * face = i < color_attachment_count ? PyTuple_GetItem(color_attachments, i) : depth_stencil_attachment;
+        int transient = face != Py_None ? is_transient_attachment(exporter, (ImageFace *)face, true) : false;
+        if (transient < 0) {
+            return -1;
+        }
+        if (transient && !bound) {
+            print_stream(s, "glBindFramebuffer(GL_FRAMEBUFFER, framebuffer%d);\n", self->framebuffer->obj);
+            bound = true;
+        }
+        if (transient) {
+            print_clear_attachment(s, exporter, (ImageFace *)face, i < color_attachment_count ? i : -1);
+        }
+    }
+    return 0;
+}
+
+int print_pipeline(Stream * s, Exporter * exporter, Pipeline * self) {
+    if (print_clear_attachments(s, exporter, self) < 0) {
+        return -1;
+    }
+
+    print_settings(s, self->global_settings);
+    print_stream(s, "glViewport(%d, %d, %d, %d);\n", self->viewport.x, self->viewport.y, self->viewport.width, self->viewport.height);
+    print_stream(s, "glBindFramebuffer(GL_FRAMEBUFFER, framebuffer%d);\n", self->framebuffer->obj);
+    print_stream(s, "glUseProgram(program%d);\n", self->program->obj);
+
+    if (exporter->separate_vertex_format) {
+        if (exporter->current_vertex_array != self->vertex_array->obj) {
+            PyObject * vertex_array = get_vertex_array(exporter, self->vertex_array->obj);
+            int vertex_layout = PyLong_AsLong(PyTuple_GetItem(vertex_array, 0));
+            if (exporter->current_vertex_layout != vertex_layout) {
+                print_stream(s, "glBindVertexArray(vertex_layout%d);\n", vertex_layout);
+                exporter->current_vertex_layout = vertex_layout;
+            }
+            print_vertex_buffers(s, exporter, PyTuple_GetItem(vertex_array, 1));
+            exporter->current_vertex_array = self->vertex_array->obj;
+        }
+    } else {
+        print_stream(s, "glBindVertexArray(vertex_array%d);\n", self->vertex_array->obj);
+    }
+
+    for (int i = 0; i < self->descriptor_set_buffers->buffers; ++i) {
+        int buffer = self->descriptor_set_buffers->binding[i].buffer;
+        int offset = self->descriptor_set_buffers->binding[i].offset;
+        int size = self->descriptor_set_buffers->binding[i].size;
+        BufferRef ref = get_buffer_ref(exporter, buffer, offset);
+        print_stream(s, "glBindBufferRange(GL_UNIFORM_BUFFER, %d, %s, %s, %d);\n", i, ref.name, ref.offset, size);
+    }
+
+    for (int i = 0; i < self->descriptor_set_images->samplers; ++i) {
+        int image = self->descriptor_set_images->binding[i].image;
+        int sampler = self->descriptor_set_images->binding[i].sampler;
+        if (!exporter->texture_arrays) {
+            print_stream(s, "glActiveTexture(GL_TEXTURE%d);\n", i);
+            print_stream(s, "glBindTexture(%s, image%d);\n", str_texture_target(self->descriptor_set_images->binding[i].target), image);
+            print_stream(s, "glBindSampler(%d, sampler%d);\n", i, sampler);
+            continue;
+        }
+        int texture_array = get_texture_array(exporter, image);
+        int texture = texture_array >= 0 ? -1 - texture_array : image;
+        if (exporter->current_textures[i] != texture) {
+            print_stream(s, "glActiveTexture(GL_TEXTURE%d);\n", i);
+            if (texture_array >= 0) {
+                print_stream(s, "glBindTexture(GL_TEXTURE_2D_ARRAY, texture_array%d);\n", texture_array);
+            } else {
+                print_stream(s, "glBindTexture(%s, image%d);\n", str_texture_target(self->descriptor_set_images->binding[i].target), image);
+            }
+            exporter->current_textures[i] = texture;
+        }
+        if (exporter->current_samplers[i] != sampler) {
+            print_stream(s, "glBindSampler(%d, sampler%d);\n", i, sampler);
+            exporter->current_samplers[i] = sampler;
+        }
+    }
+
+    int texture_layers[MAX_SAMPLER_BINDINGS];
+    if (get_texture_layers(exporter, self, texture_layers)) {
+        print_stream(s, "int texture_layers%d[] = {", exporter->pipeline_index);
+        for (int i = 0; i < self->descriptor_set_images->samplers; ++i) {
+            print_stream(s, "%s%d", i ? ", " : "", texture_layers[i]);
+        }
+        print_stream(s, "};\n");
+        print_stream(s, "if (program%d_texture_layers != -1) {\n", self->program->obj);
+        print_stream(s, "    glUniform1iv(program%d_texture_layers, %d, texture_layers%d);\n", self->program->obj, self->descriptor_set_images->samplers, exporter->pipeline_index);
+        print_stream(s, "}\n");
+    }
+
+    PyObject * vertex_array = get_vertex_array(exporter, self->vertex_array->obj);
+    PyObject * index_buffer = vertex_array ? PyTuple_GetItem(PyTuple_GetItem(vertex_array, 1), 0) : Py_None;
+
+    if (self->index_type) {
+        char index_offset[80] = "";
+        if (index_buffer != Py_None) {
+            BufferRef index_ref = get_buffer_ref(exporter, ((Buffer *)index_buffer)->buffer, 0);
+            if (!index_ref.plain) {
+                sprintf(index_offset, "%s + ", index_ref.offset);
+            }
+        }
+        print_stream(s, "glDrawElementsInstanced(%s, %d, %s, %s%d * %d, %d);\n", str_topology(self->topology), self->vertex_count, str_format(self->index_type), index_offset, self->first_vertex, self->index_size, self->instance_count);
+    } else {
+        print_stream(s, "glDrawArraysInstanced(%s, %d, %d, %d);\n", str_topology(self->topology), self->first_vertex, self->vertex_count, self->instance_count);
+    }
+
+    if (exporter->invalidate_framebuffers) {
+        PyObject * attachments = get_framebuffer_attachments(exporter, self->framebuffer->obj);
+        if (attachments && print_invalidate_framebuffer(s, exporter, "GL_FRAMEBUFFER", attachments) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void print_default_settings(Stream * s) {
+    print_stream(s, "glPrimitiveRestartIndex(-1);\n");
+    print_stream(s, "glEnable(GL_PROGRAM_POINT_SIZE);\n");
+    print_stream(s, "glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);\n");
+    print_stream(s, "glEnable(GL_FRAMEBUFFER_SRGB);\n");
+}
+
+int print_blit_framebuffer(Stream * s, Exporter * exporter, int framebuffer) {
+    PyObject * attachments = get_framebuffer_attachments(exporter, framebuffer);
+    if (!attachments || !PyTuple_Size(PyTuple_GetItem(attachments, 1))) {
+        if (exporter->frame_replay) {
+            PyErr_Format(PyExc_ValueError, "frame_replay requires the last pipeline to render to a color attachment");
+            return -1;
+        }
+        print_stream(s, "glDisable(GL_FRAMEBUFFER_SRGB);\n");
+        print_stream(s, "glColorMaski(0, true, true, true, true);\n");
+        print_stream(s, "glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);\n");
+        print_stream(s, "glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);\n");
+        print_stream(s, "glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);\n");
+        print_stream(s, "glEnable(GL_FRAMEBUFFER_SRGB);\n");
+        return 0;
+    }
+
+    ImageFace * face = (ImageFace *)PyTuple_GetItem(PyTuple_GetItem(attachments, 1), 0);
+    print_stream(s, "glDisable(GL_FRAMEBUFFER_SRGB);\n");
+    print_stream(s, "glColorMaski(0, true, true, true, true);\n");
+    print_stream(s, "glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer%d);\n", framebuffer);
+    print_stream(s, "glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);\n");
+    print_stream(s, "glBlitFramebuffer(0, 0, %d, %d, 0, 0, %d, %d, GL_COLOR_BUFFER_BIT, GL_NEAREST);\n", face->width, face->height, face->width, face->height);
+    if (exporter->invalidate_framebuffers && print_invalidate_framebuffer(s, exporter, "GL_READ_FRAMEBUFFER", attachments) < 0) {
+        return -1;
+    }
+    print_stream(s, "glEnable(GL_FRAMEBUFFER_SRGB);\n");
+    return 0;
+}
+
+struct CommandList {
+    Stream settings;
+    Stream clears;
+    Stream buffer_bindings;
+    Stream texture_bindings;
+    Stream texture_layers;
+    Stream invalidate_attachments;
+    Stream commands;
+    PyObject * global_settings;
+    int clear_count;
+    int buffer_binding_count;
+    int texture_binding_count;
+    int texture_layer_count;
+    int invalidate_attachment_count;
+    int command_count;
+};
+
+void release_command_list(CommandList * list) {
+    release_stream(&list->settings);
+    release_stream(&list->clears);
+    release_stream(&list->buffer_bindings);
+    release_stream(&list->texture_bindings);
+    release_stream(&list->texture_layers);
+    release_stream(&list->invalidate_attachments);
+    release_stream(&list->commands);
+    Py_XDECREF(list->global_settings);
+}
+
+const char * line_end(const char * line, const char * end) {
+    while (line < end && *line != '\n') {
+        line += 1;
+    }
+    return line;
+}
+
+void print_indented(Stream * s, const char * begin, const char * end) {
+    bool blank = false;
+    bool started = false;
+    for (const char * line = begin; line < end; line = line_end(line, end) + 1) {
+        const char * stop = line_end(line, end);
+        if (line == stop) {
+            blank = started;
+            continue;
+        }
+        if (blank) {
+            print_stream(s, "\n");
+            blank = false;
+        }
+        print_stream(s, "    %.*s\n", (int)(stop - line), line);
+        started = true;
+    }
+}
+
+int add_buffer_binding(CommandList * list, Exporter * exporter, int index, int buffer, int offset, int size) {
+    int pool_offset = get_buffer_offset(exporter, buffer);
+    int ring_stride = get_ring_stride(exporter, buffer);
+    BufferRef ref = get_buffer_ref(exporter, buffer, offset);
+    print_stream(&list->buffer_bindings, "{%d, &%s, %d, %d, %d},\n", index, ref.name, offset + (pool_offset >= 0 ? pool_offset : 0), ring_stride >= 0 ? ring_stride : 0, size);
+    return list->buffer_binding_count++;
+}
+
+int get_global_settings(CommandList * list, GlobalSettings * settings) {
+    Stream text = {};
+    print_settings(&text, settings);
+
+    PyObject * settings_key = text.failed ? PyErr_NoMemory() : PyBytes_FromStringAndSize(text.data, text.size);
+    if (!settings_key) {
+        release_stream(&text);
+        return -1;
+    }
+
+    PyObject * value = PyDict_GetItem(list->global_settings, settings_key);
+    if (value) {
+        Py_DECREF(settings_key);
+        release_stream(&text);
+        return PyLong_AsLong(value);
+    }
+
+    int global_settings = (int)PyDict_Size(list->global_settings);
+    value = PyLong_FromLong(global_settings);
+    if (!value || PyDict_SetItem(list->global_settings, settings_key, value) < 0) {
+        Py_XDECREF(value);
+        Py_DECREF(settings_key);
+        release_stream(&text);
+        return -1;
+    }
+    Py_DECREF(value);
+    Py_DECREF(settings_key);
+
+    print_stream(&list->settings, "void global_settings%d() {\n", global_settings);
+    print_indented(&list->settings, text.data, text.data + text.size);
+    print_stream(&list->settings, "}\n\n");
+    release_stream(&text);
+    return global_settings;
+}
+
+int add_clear(CommandList * list, Exporter * exporter, Pipeline * self, char * name) {
+    Stream text = {};
+    if (print_clear_attachments(&text, exporter, self) < 0) {
+        release_stream(&text);
+        return -1;
+    }
+    if (text.size) {
+        sprintf(name, "clear%d", list->clear_count);
+        print_stream(&list->clears, "void clear%d() {\n", list->clear_count);
+        print_indented(&list->clears, text.data, text.data + text.size);
+        print_stream(&list->clears, "}\n\n");
+        list->clear_count += 1;
+    }
+    bool failed = text.failed;
+    release_stream(&text);
+    return failed ? -1 : 0;
+}
+
+int add_command(CommandList * list, Exporter * exporter, Pipeline * self) {
+    char clear_name[64] = "NULL";
+    if (add_clear(list, exporter, self, clear_name) < 0) {
+        return -1;
+    }
+
+    int global_settings = get_global_settings(list, self->global_settings);
+    if (global_settings < 0) {
+        return -1;
+    }
+
+    PyObject * vertex_array = get_vertex_array(exporter, self->vertex_array->obj);
+    PyObject * index_buffer = vertex_array ? PyTuple_GetItem(PyTuple_GetItem(vertex_array, 1), 0) : Py_None;
+    char vertex_array_name[64];
+    char index_buffer_name[64] = "NULL";
+    int vertex_buffers = list->buffer_binding_count;
+
+    if (exporter->separate_vertex_format) {
+        PyObject * bindings = PyTuple_GetItem(vertex_array, 1);
+        sprintf(vertex_array_name, "&vertex_layout%d", (int)PyLong_AsLong(PyTuple_GetItem(vertex_array, 0)));
+        if (exporter->current_vertex_array != self->vertex_array->obj) {
+            VertexBinding vertex_bindings[MAX_VERTEX_ATTRIBUTES];
+            int attribute_bindings[MAX_VERTEX_ATTRIBUTES];
+            int binding_count = get_vertex_bindings(bindings, vertex_bindings, attribute_bindings);
+            for (int i = 0; i < binding_count; ++i) {
+                add_buffer_binding(list, exporter, i, vertex_bindings[i].buffer->buffer, vertex_bindings[i].offset, vertex_bindings[i].stride);
+            }
+            if (index_buffer != Py_None) {
+                sprintf(index_buffer_name, "&%s", get_buffer_ref(exporter, ((Buffer *)index_buffer)->buffer, 0).name);
+            }
+            exporter->current_vertex_array = self->vertex_array->obj;
+        }
+    } else {
+        sprintf(vertex_array_name, "&vertex_array%d", self->vertex_array->obj);
+    }
+
+    int vertex_buffer_count = list->buffer_binding_count - vertex_buffers;
+    int uniform_buffers = list->buffer_binding_count;
+
+    for (int i = 0; i < self->descriptor_set_buffers->buffers; ++i) {
+        int buffer = self->descriptor_set_buffers->binding[i].buffer;
+        int offset = self->descriptor_set_buffers->binding[i].offset;
+        int size = self->descriptor_set_buffers->binding[i].size;
+        add_buffer_binding(list, exporter, i, buffer, offset, size);
+    }
+
+    int uniform_buffer_count = list->buffer_binding_count - uniform_buffers;
+    int textures = list->texture_binding_count;
+
+    for (int i = 0; i < self->descriptor_set_images->samplers; ++i) {
+        int image = self->descriptor_set_images->binding[i].image;
+        int sampler = self->descriptor_set_images->binding[i].sampler;
+        int texture_array = exporter->texture_arrays ? get_texture_array(exporter, image) : -1;
+        int texture = texture_array >= 0 ? -1 - texture_array : image;
+        const char * target = texture_array >= 0 ? "GL_TEXTURE_2D_ARRAY" : str_texture_target(self->descriptor_set_images->binding[i].target);
+        char texture_name[64] = "NULL";
+        char sampler_name[64] = "NULL";
+        if (!exporter->texture_arrays || exporter->current_textures[i] != texture) {
+            if (texture_array >= 0) {
+                sprintf(texture_name, "&texture_array%d", texture_array);
+            } else {
+                sprintf(texture_name, "&image%d", image);
+            }
+            exporter->current_textures[i] = texture;
+        }
+        if (!exporter->texture_arrays || exporter->current_samplers[i] != sampler) {
+            sprintf(sampler_name, "&sampler%d", sampler);
+            exporter->current_samplers[i] = sampler;
+        }
+        if (strcmp(texture_name, "NULL") || strcmp(sampler_name, "NULL")) {
+            print_stream(&list->texture_bindings, "{%d, %s, %s, %s},\n", i, target, texture_name, sampler_name);
+            list->texture_binding_count += 1;
+        }
+    }
+
+    int texture_count = list->texture_binding_count - textures;
+    int texture_layers = list->texture_layer_count;
+    int texture_layer_count = 0;
+    char texture_layers_location[64] = "NULL";
+    int layers[MAX_SAMPLER_BINDINGS];
+
+    if (get_texture_layers(exporter, self, layers)) {
+        texture_layer_count = self->descriptor_set_images->samplers;
+        for (int i = 0; i < texture_layer_count; ++i) {
+            print_stream(&list->texture_layers, "%s%d", i ? ", " : "", layers[i]);
+        }
+        print_stream(&list->texture_layers, ",\n");
+        list->texture_layer_count += texture_layer_count;
+        sprintf(texture_layers_location, "&program%d_texture_layers", self->program->obj);
+    }
+
+    int invalidate = list->invalidate_attachment_count;
+    int invalidate_count = 0;
+
+    if (exporter->invalidate_framebuffers) {
+        PyObject * attachments = get_framebuffer_attachments(exporter, self->framebuffer->obj);
+        if (attachments) {
+            char names[MAX_ATTACHMENTS + 1][32];
+            invalidate_count = get_invalidate_attachments(exporter, attachments, names);
+            if (invalidate_count < 0) {
+                return -1;
+            }
+            for (int i = 0; i < invalidate_count; ++i) {
+                print_stream(&list->invalidate_attachments, "%s,\n", names[i]);
+            }
+            list->invalidate_attachment_count += invalidate_count;
+        }
+    }
+
+    int index_offset = 0;
+    int index_ring_stride = 0;
+
+    if (self->index_type && index_buffer != Py_None) {
+        int pool_offset = get_buffer_offset(exporter, ((Buffer *)index_buffer)->buffer);
+        int ring_stride = get_ring_stride(exporter, ((Buffer *)index_buffer)->buffer);
+        index_offset = (pool_offset >= 0 ? pool_offset : 0) + self->first_vertex * self->index_size;
+        index_ring_stride = ring_stride >= 0 ? ring_stride : 0;
+    }
+
+    print_stream(
+        &list->commands,
+        "{%s, global_settings%d, {%d, %d, %d, %d}, &framebuffer%d, &program%d, %s, %s, %d, %d, %d, %d, %d, %d, %s, %d, %d, %s, %s, %d, %d, %d, %d, %d, %d, %d},\n",
+        clear_name,
+        global_settings,
+        self->viewport.x,
+        self->viewport.y,
+        self->viewport.width,
+        self->viewport.height,
+        self->framebuffer->obj,
+        self->program->obj,
+        vertex_array_name,
+        index_buffer_name,
+        vertex_buffers,
+        vertex_buffer_count,
+        uniform_buffers,
+        uniform_buffer_count,
+        textures,
+        texture_count,
+        texture_layers_location,
+        texture_layers,
+        texture_layer_count,
+        str_topology(self->topology),
+        self->index_type ? str_format(self->index_type) : "0",
+        index_offset,
+        index_ring_stride,
+        self->first_vertex,
+        self->vertex_count,
+        self->instance_count,
+        invalidate,
+        invalidate_count
+    );
+    list->command_count += 1;
+    return 0;
+}
+
+void print_command_types(Stream * s) {
+    print_stream(s, "struct BufferBinding {\n");
+    print_stream(s, "    int index;\n");
+    print_stream(s, "    unsigned * buffer;\n");
+    print_stream(s, "    int offset;\n");
+    print_stream(s, "    int ring_stride;\n");
+    print_stream(s, "    int size;\n");
+    print_stream(s, "};\n");
+    print_stream(s, "\n");
+    print_stream(s, "struct TextureBinding {\n");
+    print_stream(s, "    int unit;\n");
+    print_stream(s, "    unsigned target;\n");
+    print_stream(s, "    unsigned * texture;\n");
+    print_stream(s, "    unsigned * sampler;\n");
+    print_stream(s, "};\n");
+    print_stream(s, "\n");
+    print_stream(s, "struct Command {\n");
+    print_stream(s, "    void (* clear)();\n");
+    print_stream(s, "    void (* settings)();\n");
+    print_stream(s, "    int viewport[4];\n");
+    print_stream(s, "    unsigned * framebuffer;\n");
+    print_stream(s, "    unsigned * program;\n");
+    print_stream(s, "    unsigned * vertex_array;\n");
+    print_stream(s, "    unsigned * index_buffer;\n");
+    print_stream(s, "    int vertex_buffers;\n");
+    print_stream(s, "    int vertex_buffer_count;\n");
+    print_stream(s, "    int uniform_buffers;\n");
+    print_stream(s, "    int uniform_buffer_count;\n");
+    print_stream(s, "    int textures;\n");
+    print_stream(s, "    int texture_count;\n");
+    print_stream(s, "    int * texture_layers_location;\n");
+    print_stream(s, "    int texture_layers;\n");
+    print_stream(s, "    int texture_layer_count;\n");
+    print_stream(s, "    unsigned topology;\n");
+    print_stream(s, "    unsigned index_type;\n");
+    print_stream(s, "    int index_offset;\n");
+    print_stream(s, "    int index_ring_stride;\n");
+    print_stream(s, "    int first_vertex;\n");
+    print_stream(s, "    int vertex_count;\n");
+    print_stream(s, "    int instance_count;\n");
+    print_stream(s, "    int invalidate;\n");
+    print_stream(s, "    int invalidate_count;\n");
+    print_stream(s, "};\n");
+}
+
+void print_command_table(Stream * s, const char * type, const char * name, Stream * table) {
+    if (!table->size) {
+        print_stream(s, "const %s * %s = NULL;\n", type, name);
+        return;
+    }
+    print_stream(s, "const %s %s[] = {\n", type, name);
+    print_indented(s, table->data, table->data + table->size);
+    print_stream(s, "};\n");
+}
+
+void print_command_loop(Stream * s, bool rings) {
+    const char * ring_offset = rings ? " + buffer_ring * binding->ring_stride" : "";
+    const char * index_ring_offset = rings ? " + buffer_ring * command->index_ring_stride" : "";
+    print_stream(s, "    void (* settings)() = NULL;\n");
+    print_stream(s, "    unsigned * framebuffer = NULL;\n");
+    print_stream(s, "    unsigned * program = NULL;\n");
+    print_stream(s, "    unsigned * vertex_array = NULL;\n");
+    print_stream(s, "    for (int i = 0; i < command_count; ++i) {\n");
+    print_stream(s, "        const Command * command = &commands[i];\n");
+    print_stream(s, "        if (command->clear) {\n");
+    print_stream(s, "            command->clear();\n");
+    print_stream(s, "            framebuffer = command->framebuffer;\n");
+    print_stream(s, "            settings = NULL;\n");
+    print_stream(s, "        }\n");
+    print_stream(s, "        if (command->settings != settings) {\n");
+    print_stream(s, "            settings = command->settings;\n");
+    print_stream(s, "            settings();\n");
+    print_stream(s, "        }\n");
+    print_stream(s, "        glViewport(command->viewport[0], command->viewport[1], command->viewport[2], command->viewport[3]);\n");
+    print_stream(s, "        if (command->framebuffer != framebuffer) {\n");
+    print_stream(s, "            framebuffer = command->framebuffer;\n");
+    print_stream(s, "            glBindFramebuffer(GL_FRAMEBUFFER, *framebuffer);\n");
+    print_stream(s, "        }\n");
+    print_stream(s, "        if (command->program != program) {\n");
+    print_stream(s, "            program = command->program;\n");
+    print_stream(s, "            glUseProgram(*program);\n");
+    print_stream(s, "        }\n");
+    print_stream(s, "        if (command->vertex_array != vertex_array) {\n");
+    print_stream(s, "            vertex_array = command->vertex_array;\n");
+    print_stream(s, "            glBindVertexArray(*vertex_array);\n");
+    print_stream(s, "        }\n");
+    print_stream(s, "        for (int j = 0; j < command->vertex_buffer_count; ++j) {\n");
+    print_stream(s, "            const BufferBinding * binding = &buffer_bindings[command->vertex_buffers + j];\n");
+    print_stream(s, "            glBindVertexBuffer(binding->index, *binding->buffer, binding->offset%s, binding->size);\n", ring_offset);
+    print_stream(s, "        }\n");
+    print_stream(s, "        if (command->index_buffer) {\n");
+    print_stream(s, "            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, *command->index_buffer);\n");
+    print_stream(s, "        }\n");
+    print_stream(s, "        for (int j = 0; j < command->uniform_buffer_count; ++j) {\n");
+    print_stream(s, "            const BufferBinding * binding = &buffer_bindings[command->uniform_buffers + j];\n");
+    print_stream(s, "            glBindBufferRange(GL_UNIFORM_BUFFER, binding->index, *binding->buffer, binding->offset%s, binding->size);\n", ring_offset);
+    print_stream(s, "        }\n");
+    print_stream(s, "        for (int j = 0; j < command->texture_count; ++j) {\n");
+    print_stream(s, "            const TextureBinding * binding = &texture_bindings[command->textures + j];\n");
+    print_stream(s, "            if (binding->texture) {\n");
+    print_stream(s, "                glActiveTexture(GL_TEXTURE0 + binding->unit);\n");
+    print_stream(s, "                glBindTexture(binding->target, *binding->texture);\n");
+    print_stream(s, "            }\n");
+    print_stream(s, "            if (binding->sampler) {\n");
+    print_stream(s, "                glBindSampler(binding->unit, *binding->sampler);\n");
+    print_stream(s, "            }\n");
+    print_stream(s, "        }\n");
+    print_stream(s, "        if (command->texture_layer_count && *command->texture_layers_location != -1) {\n");
+    print_stream(s, "            glUniform1iv(*command->texture_layers_location, command->texture_layer_count, &texture_layers[command->texture_layers]);\n");
+    print_stream(s, "        }\n");
+    print_stream(s, "        if (command->index_type) {\n");
+    print_stream(s, "            intptr_t index_offset = command->index_offset%s;\n", index_ring_offset);
+    print_stream(s, "            glDrawElementsInstanced(command->topology, command->vertex_count, command->index_type, (void *)index_offset, command->instance_count);\n");
+    print_stream(s, "        } else {\n");
+    print_stream(s, "            glDrawArraysInstanced(command->topology, command->first_vertex, command->vertex_count, command->instance_count);\n");
+    print_stream(s, "        }\n");
+    print_stream(s, "        if (command->invalidate_count) {\n");
+    print_stream(s, "            glInvalidateFramebuffer(GL_FRAMEBUFFER, command->invalidate_count, &invalidate_attachments[command->invalidate]);\n");
+    print_stream(s, "        }\n");
+    print_stream(s, "    }\n");
+}
+
+PyObject * export_frame_replay(Exporter * exporter, Context * ctx, Stream * init, int final_framebuffer) {
+    bool rings = PyDict_Size(exporter->ring_strides) > 0;
+    int init_end = init->size;
+
+    if (rings) {
+        print_ring_begin(init, exporter, ctx);
+        if (!exporter->separate_vertex_format) {
+            print_vertex_array_ring_offsets(init, exporter);
+        }
+    }
+
+    int prelude_end = init->size;
+
+    CommandList list = {};
+    list.global_settings = PyDict_New();
+    if (!list.global_settings) {
+        return NULL;
+    }
+
+    GCHeader * it = ctx->gc_next;
+    while (it != (GCHeader *)ctx) {
+        if (Py_TYPE(it) == ctx->module_state->Pipeline_type) {
+            if (add_command(&list, exporter, (Pipeline *)it) < 0) {
+                release_command_list(&list);
+                return NULL;
+            }
+            exporter->pipeline_index += 1;
+        }
+        it = it->gc_next;
+    }
+
+    if (print_blit_framebuffer(init, exporter, final_framebuffer) < 0) {
+        release_command_list(&list);
+        return NULL;
+    }
+
+    if (rings) {
+        print_ring_end(init);
+    }
+
+    int frame_end = init->size;
+    Stream out = {};
+
+    write_stream(&out, exporter->globals.data, exporter->globals.size);
+    print_stream(&out, "\n");
+
+    write_stream(&out, list.settings.data, list.settings.size);
+    write_stream(&out, list.clears.data, list.clears.size);
+
+    print_command_types(&out);
+    print_stream(&out, "\n");
+
+    print_command_table(&out, "BufferBinding", "buffer_bindings", &list.buffer_bindings);
+    print_stream(&out, "\n");
+    print_command_table(&out, "TextureBinding", "texture_bindings", &list.texture_bindings);
+    print_stream(&out, "\n");
+    print_command_table(&out, "int", "texture_layers", &list.texture_layers);
+    print_stream(&out, "\n");
+    print_command_table(&out, "unsigned", "invalidate_attachments", &list.invalidate_attachments);
+    print_stream(&out, "\n");
+    print_command_table(&out, "Command", "commands", &list.commands);
+    print_stream(&out, "const int command_count = %d;\n", list.command_count);
+    print_stream(&out, "\n");
+
+    print_stream(&out, "void init() {\n");
+    print_indented(&out, init->data, init->data + init_end);
+    print_stream(&out, "}\n");
+    print_stream(&out, "\n");
+
+    print_stream(&out, "void render_frame() {\n");
+    if (prelude_end != init_end) {
+        print_indented(&out, init->data + init_end, init->data + prelude_end);
+        print_stream(&out, "\n");
+    }
+    print_command_loop(&out, rings);
+    if (frame_end != prelude_end) {
+        print_stream(&out, "\n");
+        print_indented(&out, init->data + prelude_end, init->data + frame_end);
+    }
+    print_stream(&out, "}\n");
+    print_stream(&out, "\n");
+
+    print_stream(&out, "void shutdown() {\n");
+    print_indented(&out, exporter->shutdown.data, exporter->shutdown.data + exporter->shutdown.size);
+    print_stream(&out, "}\n");
+
+    bool failed = out.failed || init->failed || exporter->globals.failed || exporter->shutdown.failed;
+    failed = failed || list.settings.failed || list.clears.failed || list.buffer_bindings.failed || list.texture_bindings.failed;
+    failed = failed || list.texture_layers.failed || list.invalidate_attachments.failed || list.commands.failed;
+    PyObject * res = failed ? PyErr_NoMemory() : PyUnicode_FromStringAndSize(out.data, out.size);
+    release_command_list(&list);
+    release_stream(&out);
+    return res;
+}
+
+int add_attached_image(PyObject * attached_images, PyObject * face) {
+    if (face == Py_None) {
+        return 0;
+    }
+    PyObject * image_key = get_image_key(((ImageFace *)face)->image->renderbuffer, ((ImageFace *)face)->image->image);
+    int res = image_key ? PySet_Add(attached_images, image_key) : -1;
+    Py_XDECREF(image_key);
+    return res;
+}
+
+PyObject * get_unit_images(Context * ctx) {
+    PyObject * res = PyDict_New();
+    GCHeader * it = ctx->gc_next;
+    while (res && it != (GCHeader *)ctx) {
+        if (Py_TYPE(it) == ctx->module_state->Pipeline_type) {
+            Pipeline * pipeline = (Pipeline *)it;
+            for (int i = 0; res && i < pipeline->descriptor_set_images->samplers; ++i) {
+                PyObject * unit_key = Py_BuildValue("(ii)", pipeline->program->obj, i);
+                PyObject * images = unit_key ? PyDict_GetItem(res, unit_key) : NULL;
+                if (unit_key && !images) {
+                    images = PyList_New(0);
+                    if (images && PyDict_SetItem(res, unit_key, images) < 0) {
+                        Py_CLEAR(images);
+                    }
+                    Py_XDECREF(images);
+                }
+                PyObject * image_key = images ? PyLong_FromLong(pipeline->descriptor_set_images->binding[i].image) : NULL;
+                if (!image_key || PyList_Append(images, image_key) < 0) {
+                    Py_CLEAR(res);
+                }
+                Py_XDECREF(image_key);
+                Py_XDECREF(unit_key);
+            }
+        }
+        it = it->gc_next;
+    }
+    return res;
+}
+
+PyObject * build_texture_arrays(Exporter * exporter, PyObject * candidates, PyObject * excluded) {
+    PyObject * groups = PyDict_New();
+    PyObject * res = groups ? PyList_New(0) : NULL;
+    PyDict_Clear(exporter->texture_layers);
+
+    for (int i = 0; res && i < (int)PyList_Size(candidates); ++i) {
+        Image * image = (Image *)PyList_GetItem(candidates, i);
+        PyObject * image_key = PyLong_FromLong(image->image);
+        int skip = image_key ? PySet_Contains(excluded, image_key) : -1;
+        Py_XDECREF(image_key);
+        PyObject * group_key = skip == 0 ? Py_BuildValue("(iii)", image->format.internal_format, image->width, image->height) : NULL;
+        PyObject * group = group_key ? PyDict_GetItem(groups, group_key) : NULL;
+        if (group_key && !group) {
+            group = PyList_New(0);
+            if (group && PyDict_SetItem(groups, group_key, group) < 0) {
+                Py_CLEAR(group);
+            }
+            Py_XDECREF(group);
+        }
+        Py_XDECREF(group_key);
+        if (skip < 0 || (!skip && (!group || PyList_Append(group, (PyObject *)image) < 0))) {
+            Py_CLEAR(res);
+        }
+    }
+
+    PyObject * key;
+    PyObject * value;
+    Py_ssize_t pos = 0;
+    while (res && PyDict_Next(groups, &pos, &key, &value)) {
+        for (int start = 0; res && start < (int)PyList_Size(value); start += MAX_TEXTURE_ARRAY_LAYERS) {
+            PyObject * images = PyList_GetSlice(value, start, start + MAX_TEXTURE_ARRAY_LAYERS);
+            if (!images) {
+                Py_CLEAR(res);
+                break;
+            }
+            if (PyList_Size(images) < 2) {
+                Py_DECREF(images);
+                continue;
+            }
+            int texture_array = (int)PyList_Size(res);
+            for (int i = 0; i < (int)PyList_Size(images); ++i) {
+                PyObject * image_key = PyLong_FromLong(((Image *)PyList_GetItem(images, i))->image);
+                PyObject * texture_layer = Py_BuildValue("(ii)", texture_array, i);
+                if (!image_key || !texture_layer || PyDict_SetItem(exporter->texture_layers, image_key, texture_layer) < 0) {
+                    Py_CLEAR(res);
+                }
+                Py_XDECREF(image_key);
+                Py_XDECREF(texture_layer);
+                if (!res) {
+                    break;
+                }
+            }
+            if (res && PyList_Append(res, images) < 0) {
+                Py_CLEAR(res);
+            }
+            Py_DECREF(images);
+        }
+    }
+
+    Py_XDECREF(groups);
+    return res;
+}
+
+int exclude_partial_units(Exporter * exporter, PyObject * unit_images, PyObject * excluded) {
+    PyObject * key;
+    PyObject * images;
+    Py_ssize_t pos = 0;
+    int changed = false;
+
+    while (PyDict_Next(unit_images, &pos, &key, &images)) {
+        bool partial = false;
+        for (int i = 0; i < (int)PyList_Size(images); ++i) {
+            partial = partial || !PyDict_GetItem(exporter->texture_layers, PyList_GetItem(images, i));
+        }
+        for (int i = 0; partial && i < (int)PyList_Size(images); ++i) {
+            PyObject * image_key = PyList_GetItem(images, i);
+            if (PyDict_GetItem(exporter->texture_layers, image_key)) {
+                if (PySet_Add(excluded, image_key) < 0) {
+                    return -1;
+                }
+                changed = true;
+            }
+        }
+    }
+
+    return changed;
+}
+
+PyObject * group_texture_arrays(Exporter * exporter, Context * ctx) {
+    PyObject * attached_images = PySet_New(NULL);
+    PyObject * candidates = PyList_New(0);
+    if (!attached_images || !candidates) {
+        Py_XDECREF(attached_images);
+        Py_XDECREF(candidates);
+        return NULL;
+    }
+
+    PyObject * key;
+    PyObject * value;
+    Py_ssize_t pos = 0;
+    int failed = false;
+
+    Py_BEGIN_CRITICAL_SECTION(ctx->framebuffer_cache);
+    while (PyDict_Next(ctx->framebuffer_cache, &pos, &key, &value)) {
+        PyObject * color_attachments = PyTuple_GetItem(key, 1);
+        for (int i = 0; i < (int)PyTuple_Size(color_attachments); ++i) {
+            if (add_attached_image(attached_images, PyTuple_GetItem(color_attachments, i)) < 0) {
+                failed = true;
+            }
+        }
+        if (add_attached_image(attached_images, PyTuple_GetItem(key, 2)) < 0) {
+            failed = true;
+        }
+        if (failed) {
+            break;
+        }
+    }
+    Py_END_CRITICAL_SECTION();
+
+    GCHeader * it = ctx->gc_next;
+    while (!failed && it != (GCHeader *)ctx) {
+        if (Py_TYPE(it) == ctx->module_state->Image_type) {
+            Image * image = (Image *)it;
+            PyObject * image_key = get_image_key(image->renderbuffer, image->image);
+            int attached = image_key ? PySet_Contains(attached_images, image_key) : -1;
+            Py_XDECREF(image_key);
+            if (attached < 0) {
+                failed = true;
+                break;
+            }
+            if (!attached && !image->renderbuffer && !image->cubemap && !image->array && image->samples <= 1 && image->target == GL_TEXTURE_2D) {
+                if (PyList_Append(candidates, (PyObject *)image) < 0) {
+                    failed = true;
+                    break;
+                }
+            }
+        }
+        it = it->gc_next;
+    }
+
+    Py_DECREF(attached_images);
+
+    PyObject * unit_images = failed ? NULL : get_unit_images(ctx);
+    PyObject * excluded = unit_images ? PySet_New(NULL) : NULL;
+    PyObject * res = NULL;
+
+    while (excluded) {
+        res = build_texture_arrays(exporter, candidates, excluded);
+        int changed = res ? exclude_partial_units(exporter, unit_images, excluded) : -1;
+        if (changed <= 0) {
+            if (changed < 0) {
+                Py_CLEAR(res);
+            }
+            break;
+        }
+        Py_DECREF(res);
+    }
+
+    Py_DECREF(candidates);
+    Py_XDECREF(unit_images);
+    Py_XDECREF(excluded);
+    return res;
+}
+
+int assign_ring_strides(Exporter * exporter, Context * ctx) {
+    GCHeader * it = ctx->gc_next;
+    while (it != (GCHeader *)ctx) {
+        if (Py_TYPE(it) == ctx->module_state->Buffer_type && ((Buffer *)it)->dynamic) {
+            Buffer * buffer = (Buffer *)it;
+            Py_ssize_t stride = align(buffer->size, exporter->buffer_alignment);
+            if (stride > INT_MAX / RING_SIZE) {
+                PyErr_Format(PyExc_OverflowError, "dynamic buffer is too large for a persistent ring");
+                return -1;
+            }
+            PyObject * buffer_key = PyLong_FromLong(buffer->buffer);
+            PyObject * ring_stride = PyLong_FromSsize_t(stride);
+            if (!buffer_key || !ring_stride || PyDict_SetItem(exporter->ring_strides, buffer_key, ring_stride) < 0) {
+                Py_XDECREF(buffer_key);
+                Py_XDECREF(ring_stride);
+                return -1;
+            }
+            Py_DECREF(buffer_key);
+            Py_DECREF(ring_stride);
+        }
+        it = it->gc_next;
+    }
+    return 0;
+}
+
+int pack_buffers(Exporter * exporter, Context * ctx) {
+    PyObject * uniform_buffers = PySet_New(NULL);
+    if (!uniform_buffers) {
+        return -1;
+    }
+
+    PyObject * key;
+    DescriptorSetBuffers * value;
+    Py_ssize_t pos = 0;
+    int failed = false;
+
+    Py_BEGIN_CRITICAL_SECTION(ctx->descriptor_set_buffers_cache);
+    while (PyDict_Next(ctx->descriptor_set_buffers_cache, &pos, &key, (PyObject **)&value)) {
+        for (int i = 0; i < value->buffers; ++i) {
+            PyObject * buffer_key = PyLong_FromLong(value->binding[i].buffer);
+            if (!buffer_key || PySet_Add(uniform_buffers, buffer_key) < 0) {
+                Py_XDECREF(buffer_key);
+                failed = true;
+                break;
+            }
+            Py_DECREF(buffer_key);
+        }
+        if (failed) {
+            break;
+        }
+    }
+    Py_END_CRITICAL_SECTION();
+
+    Py_ssize_t size = 0;
+    GCHeader * it = ctx->gc_next;
+    while (!failed && it != (GCHeader *)ctx) {
+        if (Py_TYPE(it) == ctx->module_state->Buffer_type && !((Buffer *)it)->dynamic) {
+            Buffer * buffer = (Buffer *)it;
+            PyObject * buffer_key = PyLong_FromLong(buffer->buffer);
+            int uniform = buffer_key ? PySet_Contains(uniform_buffers, buffer_key) : -1;
+            if (uniform >= 0) {
+                size = align(size, uniform ? exporter->buffer_alignment : 16);
+            }
+            if (uniform >= 0 && size + buffer->size > INT_MAX) {
+                PyErr_Format(PyExc_OverflowError, "buffer pool is too large");
+                uniform = -1;
+            }
+            PyObject * offset = uniform >= 0 ? PyLong_FromSsize_t(size) : NULL;
+            if (!offset || PyDict_SetItem(exporter->buffer_offsets, buffer_key, offset) < 0) {
+                Py_XDECREF(buffer_key);
+                Py_XDECREF(offset);
+                failed = true;
+                break;
+            }
+            Py_DECREF(buffer_key);
+            Py_DECREF(offset);
+            size += buffer->size;
+        }
+        it = it->gc_next;
+    }
+
+    Py_DECREF(uniform_buffers);
+    return failed ? -1 : (int)size;
+}
+
+void release_exporter(Exporter * exporter) {
+    Py_XDECREF(exporter->buffer_offsets);
+    Py_XDECREF(exporter->ring_strides);
+    Py_XDECREF(exporter->texture_layers);
+    Py_XDECREF(exporter->vertex_layouts);
+    Py_XDECREF(exporter->vertex_arrays);
+    Py_XDECREF(exporter->framebuffers);
+    Py_XDECREF(exporter->image_uses);
+    Py_XDECREF(exporter->sampled_images);
+    release_stream(&exporter->globals);
+    release_stream(&exporter->shutdown);
+}
+
+struct Hasher {
+    char * data;
+    int size;
+    int capacity;
+};
+
+const int CACHE_VERSION = 1;
+const double CACHE_TEMP_TIMEOUT = 3600.0;
+
+enum CacheFileKind {
+    CACHE_FILE_OTHER,
+    CACHE_FILE_ENTRY,
+    CACHE_FILE_TEMP,
+};
+
+enum ObjectCache {
+    SAMPLER_CACHE,
+    FRAMEBUFFER_CACHE,
+    VERTEX_ARRAY_CACHE,
+    SHADER_CACHE,
+    PROGRAM_CACHE,
+};
+
+void hash_data(Hasher * hasher, const void * data, int size) {
+    if (hasher->size + size > hasher->capacity) {
+        int capacity = hasher->capacity * 2 > hasher->size + size ? hasher->capacity * 2 : hasher->size + size;
+        char * grown = (char *)realloc(hasher->data, capacity);
+        if (!grown) {
+            free(hasher->data);
+            hasher->data = NULL;
+            hasher->capacity = 0;
+        } else {
+            hasher->data = grown;
+            hasher->capacity = capacity;
+        }
+    }
+    if (hasher->data) {
+        memcpy(hasher->data + hasher->size, data, size);
+        hasher->size += size;
+    }
+}
+
+void hash_int(Hasher * hasher, int value) {
+    hash_data(hasher, &value, sizeof(value));
+}
+
+int hash_object(Hasher * hasher, PyObject * obj) {
+    if (obj == Py_None) {
+        hash_int(hasher, 'n');
+    } else if (PyLong_Check(obj)) {
+        long long value = PyLong_AsLongLong(obj);
+        if (value == -1 && PyErr_Occurred()) {
+            return -1;
+        }
+        hash_int(hasher, 'i');
+        hash_data(hasher, &value, sizeof(value));
+    } else if (PyFloat_Check(obj)) {
+        double value = PyFloat_AsDouble(obj);
+        hash_int(hasher, 'f');
+        hash_data(hasher, &value, sizeof(value));
+    } else if (PyBytes_Check(obj)) {
+        hash_int(hasher, 'b');
+        hash_int(hasher, (int)PyBytes_Size(obj));
+        hash_data(hasher, PyBytes_AsString(obj), (int)PyBytes_Size(obj));
+    } else if (PyUnicode_Check(obj)) {
+        Py_ssize_t size = 0;
+        const char * data = PyUnicode_AsUTF8AndSize(obj, &size);
+        if (!data) {
+            return -1;
+        }
+        hash_int(hasher, 's');
+        hash_int(hasher, (int)size);
+        hash_data(hasher, data, (int)size);
+    } else if (PyTuple_Check(obj)) {
+        hash_int(hasher, 't');
+        hash_int(hasher, (int)PyTuple_Size(obj));
+        for (int i = 0; i < (int)PyTuple_Size(obj); ++i) {
+            if (hash_object(hasher, PyTuple_GetItem(obj, i)) < 0) {
+                return -1;
+            }
+        }
+    } else {
+        PyErr_Format(PyExc_TypeError, "cannot hash %s objects for the export cache", Py_TYPE(obj)->tp_name);
+        return -1;
+    }
+    return 0;
+}
+
+void hash_image_face(Hasher * hasher, PyObject * obj) {
+    if (obj == Py_None) {
+        hash_int(hasher, -1);
+        return;
+    }
+    ImageFace * face = (ImageFace *)obj;
+    hash_int(hasher, face->image->renderbuffer);
+    hash_int(hasher, face->image->image);
+    hash_int(hasher, face->layer);
+    hash_int(hasher, face->level);
+}
+
+int hash_cache(Hasher * hasher, PyObject * cache, int kind) {
+    PyObject * key;
+    GLObject * value;
+    Py_ssize_t pos = 0;
+    int res = 0;
+    hash_int(hasher, kind);
+    Py_BEGIN_CRITICAL_SECTION(cache);
+    while (PyDict_Next(cache, &pos, &key, (PyObject **)&value)) {
+        hash_int(hasher, value->obj);
+        if (kind == FRAMEBUFFER_CACHE) {
+            PyObject * color_attachments = PyTuple_GetItem(key, 1);
+            hash_int(hasher, (int)PyTuple_Size(color_attachments));
+            for (int i = 0; i < (int)PyTuple_Size(color_attachments); ++i) {
+                hash_image_face(hasher, PyTuple_GetItem(color_attachments, i));
+            }
+            hash_image_face(hasher, PyTuple_GetItem(key, 2));
+        } else if (kind == VERTEX_ARRAY_CACHE) {
+            int length = (int)PyTuple_Size(key);
+            PyObject ** seq = PySequence_Fast_ITEMS(key);
+            hash_int(hasher, length);
+            hash_int(hasher, seq[0] != Py_None ? ((Buffer *)seq[0])->buffer : 0);
+            for (int i = 1; i < length && res == 0; i += 6) {
+                hash_int(hasher, ((Buffer *)seq[i])->buffer);
+                for (int j = 1; j < 6 && res == 0; ++j) {
+                    res = hash_object(hasher, seq[i + j]);
+                }
+            }
+        } else {
+            res = hash_object(hasher, key);
+        }
+        if (res < 0) {
+            break;
+        }
+    }
+    Py_END_CRITICAL_SECTION();
+    return res;
+}
+
+void hash_pipeline(Hasher * hasher, Pipeline * self) {
+    GlobalSettings * settings = self->global_settings;
+    hash_data(hasher, &settings->color_mask, (int)((char *)(&settings->is_blend_default + 1) - (char *)&settings->color_mask));
+    hash_data(hasher, &self->viewport, sizeof(self->viewport));
+    hash_int(hasher, self->framebuffer->obj);
+    hash_int(hasher, self->program->obj);
+    hash_int(hasher, self->vertex_array->obj);
+    hash_int(hasher, self->descriptor_set_buffers->buffers);
+    hash_data(hasher, self->descriptor_set_buffers->binding, self->descriptor_set_buffers->buffers * (int)sizeof(UniformBufferBinding));
+    hash_int(hasher, self->descriptor_set_images->samplers);
+    hash_data(hasher, self->descriptor_set_images->binding, self->descriptor_set_images->samplers * (int)sizeof(SamplerBinding));
+    int fields[] = {self->topology, self->vertex_count, self->instance_count, self->first_vertex, self->index_type, self->index_size};
+    hash_data(hasher, fields, sizeof(fields));
+}
+
+int hash_context(Hasher * hasher, Exporter * exporter, Context * ctx) {
+    int options[] = {
+        CACHE_VERSION,
+        exporter->separate_vertex_format,
+        exporter->invalidate_framebuffers,
+        exporter->pack_buffers,
+        exporter->persistent_buffers,
+        exporter->texture_arrays,
+        exporter->frame_replay,
+        exporter->buffer_alignment,
+    };
+    hash_data(hasher, options, sizeof(options));
+
+    GCHeader * it = ctx->gc_next;
+    while (it != (GCHeader *)ctx) {
+        if (Py_TYPE(it) == ctx->module_state->Buffer_type) {
+            Buffer * buffer = (Buffer *)it;
+            int fields[] = {'B', buffer->buffer, buffer->size, buffer->dynamic};
+            hash_data(hasher, fields, sizeof(fields));
+        }
+        if (Py_TYPE(it) == ctx->module_state->Image_type) {
+            Image * image = (Image *)it;
+            int fields[] = {
+                'I', image->image, image->width, image->height, image->samples, image->array, image->cubemap, image->target, image->renderbuffer,
+                image->format.internal_format, image->format.format, image->format.type, image->format.buffer, image->format.color, image->format.clear_type,
+            };
+            hash_data(hasher, fields, sizeof(fields));
+            hash_data(hasher, &image->clear_value, sizeof(image->clear_value));
+        }
+        it = it->gc_next;
+    }
+
+    if (hash_cache(hasher, ctx->sampler_cache, SAMPLER_CACHE) < 0) {
+        return -1;
+    }
+    if (hash_cache(hasher, ctx->framebuffer_cache, FRAMEBUFFER_CACHE) < 0) {
+        return -1;
+    }
+    if (hash_cache(hasher, ctx->vertex_array_cache, VERTEX_ARRAY_CACHE) < 0) {
+        return -1;
+    }
+    if (hash_cache(hasher, ctx->shader_cache, SHADER_CACHE) < 0) {
+        return -1;
+    }
+    if (hash_cache(hasher, ctx->program_cache, PROGRAM_CACHE) < 0) {
+        return -1;
+    }
+
+    it = ctx->gc_next;
+    while (it != (GCHeader *)ctx) {
+        if (Py_TYPE(it) == ctx->module_state->Pipeline_type) {
+            hash_int(hasher, 'P');
+            hash_pipeline(hasher, (Pipeline *)it);
+        }
+        it = it->gc_next;
+    }
+
+    return hasher->data ? 0 : -1;
+}
+
+PyObject * get_cache_path(ExportModuleState * state, Exporter * exporter, Context * ctx, PyObject * cache_dir) {
+    Hasher hasher = {};
+    if (hash_context(&hasher, exporter, ctx) < 0) {
+        free(hasher.data);
+        return PyErr_Occurred() ? NULL : PyErr_NoMemory();
+    }
+
+    PyObject * digest = PyObject_CallMethod(state->hashlib, "sha256", "(y#)", hasher.data, (Py_ssize_t)hasher.size);
+    free(hasher.data);
+    if (!digest) {
+        return NULL;
+    }
+
+    PyObject * name = PyObject_CallMethod(digest, "hexdigest", NULL);
+    Py_DECREF(digest);
+    if (!name) {
+        return NULL;
+    }
+
+    PyObject * filename = PyUnicode_FromFormat("%U.txt", name);
+    PyObject * path = filename ? PyObject_CallMethod(state->os_path, "join", "(OO)", cache_dir, filename) : NULL;
+    Py_XDECREF(filename);
+    Py_DECREF(name);
+    return path;
+}
+
+bool ignore_cache_error() {
+    if (PyErr_ExceptionMatches(PyExc_OSError) || PyErr_ExceptionMatches(PyExc_ValueError)) {
+        PyErr_Clear();
+        return true;
+    }
+    return false;
+}
+
+PyObject * load_cached_export(ExportModuleState * state, PyObject * path) {
+    PyObject * file = PyObject_CallMethod(state->io, "open", "(Os)", path, "rb");
+    if (!file) {
+        ignore_cache_error();
+        return NULL;
+    }
+
+    PyObject * res = NULL;
+    PyObject * fileno = PyObject_CallMethod(file, "fileno", NULL);
+    PyObject * mmap_args = fileno ? Py_BuildValue("(Oi)", fileno, 0) : NULL;
+    PyObject * mmap_kwargs = mmap_args ? Py_BuildValue("{sN}", "access", PyObject_GetAttrString(state->mmap, "ACCESS_READ")) : NULL;
+    PyObject * mmap_type = mmap_kwargs ? PyObject_GetAttrString(state->mmap, "mmap") : NULL;
+    PyObject * mapping = mmap_type ? PyObject_Call(mmap_type, mmap_args, mmap_kwargs) : NULL;
+
+    if (mapping) {
+        Py_buffer view;
+        if (PyObject_GetBuffer(mapping, &view, PyBUF_SIMPLE) == 0) {
+            res = PyUnicode_DecodeUTF8((const char *)view.buf, view.len, NULL);
+            PyBuffer_Release(&view);
+        }
+        PyObject * closed = PyObject_CallMethod(mapping, "close", NULL);
+        Py_XDECREF(closed);
+    }
+
+    PyObject * closed = PyObject_CallMethod(file, "close", NULL);
+    Py_XDECREF(closed);
+    Py_XDECREF(fileno);
+    Py_XDECREF(mmap_args);
+    Py_XDECREF(mmap_kwargs);
+    Py_XDECREF(mmap_type);
+    Py_XDECREF(mapping);
+    Py_DECREF(file);
+
+    if (!res) {
+        ignore_cache_error();
+        return NULL;
+    }
+
+    PyObject * touched = PyObject_CallMethod(state->os, "utime", "(O)", path);
+    if (!touched && !ignore_cache_error()) {
+        Py_DECREF(res);
+        return NULL;
+    }
+    Py_XDECREF(touched);
+    return res;
+}
+
+int get_cache_file_kind(PyObject * name) {
+    Py_ssize_t length = 0;
+    const char * text = PyUnicode_AsUTF8AndSize(name, &length);
+    if (!text) {
+        PyErr_Clear();
+        return CACHE_FILE_OTHER;
+    }
+    if (length < 68 || memcmp(text + 64, ".txt", 4)) {
+        return CACHE_FILE_OTHER;
+    }
+    for (int i = 0; i < 64; ++i) {
+        if (!(text[i] >= '0' && text[i] <= '9') && !(text[i] >= 'a' && text[i] <= 'f')) {
+            return CACHE_FILE_OTHER;
+        }
+    }
+    if (length == 68) {
+        return CACHE_FILE_ENTRY;
+    }
+    if (length > 72 && text[68] == '.' && !memcmp(text + length - 4, ".tmp", 4)) {
+        return CACHE_FILE_TEMP;
+    }
+    return CACHE_FILE_OTHER;
+}
+
+int evict_cached_exports(ExportModuleState * state, PyObject * cache_dir, Py_ssize_t cache_size) {
+    PyObject * names = PyObject_CallMethod(state->os, "listdir", "(O)", cache_dir);
+    if (!names) {
+        return ignore_cache_error() ? 0 : -1;
+    }
+
+    PyObject * now = PyObject_CallMethod(state->time, "time", NULL);
+    PyObject * entries = now ? PyList_New(0) : NULL;
+    double stale = now ? PyFloat_AsDouble(now) - CACHE_TEMP_TIMEOUT : 0.0;
+    long long total = 0;
+
+    for (int i = 0; entries && i < (int)PyList_Size(names); ++i) {
+        PyObject * name = PyList_GetItem(names, i);
+        int kind = get_cache_file_kind(name);
+        if (kind == CACHE_FILE_OTHER) {
+            continue;
+        }
+        PyObject * path = PyObject_CallMethod(state->os_path, "join", "(OO)", cache_dir, name);
+        PyObject * stat = path ? PyObject_CallMethod(state->os, "stat", "(O)", path) : NULL;
+        if (!stat) {
+            Py_XDECREF(path);
+            if (ignore_cache_error()) {
+                continue;
+            }
+            Py_CLEAR(entries);
+            break;
+        }
+        if (kind == CACHE_FILE_TEMP) {
+            PyObject * mtime = PyObject_GetAttrString(stat, "st_mtime");
+            PyObject * removed = mtime && PyFloat_AsDouble(mtime) < stale ? PyObject_CallMethod(state->os, "remove", "(O)", path) : NULL;
+            if (!removed) {
+                PyErr_Clear();
+            }
+            Py_XDECREF(removed);
+            Py_XDECREF(mtime);
+            Py_DECREF(stat);
+            Py_DECREF(path);
+            continue;
+        }
+        PyObject * size = PyObject_GetAttrString(stat, "st_size");
+        PyObject * mtime = PyObject_GetAttrString(stat, "st_mtime_ns");
+        PyObject * entry = size && mtime ? Py_BuildValue("(OOO)", mtime, size, path) : NULL;
+        if (!entry || PyList_Append(entries, entry) < 0) {
+            Py_CLEAR(entries);
+        } else {
+            total += PyLong_AsLongLong(size);
+        }
+        Py_XDECREF(entry);
+        Py_XDECREF(size);
+        Py_XDECREF(mtime);
+        Py_DECREF(stat);
+        Py_DECREF(path);
+    }
+
+    Py_XDECREF(now);
+    Py_DECREF(names);
+    if (!entries || PyList_Sort(entries) < 0) {
+        Py_XDECREF(entries);
+        return -1;
+    }
+
+    for (int i = 0; total > cache_size && i < (int)PyList_Size(entries); ++i) {
+        PyObject * entry = PyList_GetItem(entries, i);
+        PyObject * removed = PyObject_CallMethod(state->os, "remove", "(O)", PyTuple_GetItem(entry, 2));
+        if (!removed && !ignore_cache_error()) {
+            Py_DECREF(entries);
+            return -1;
+        }
+        Py_XDECREF(removed);
+        total -= PyLong_AsLongLong(PyTuple_GetItem(entry, 1));
+    }
+
+    Py_DECREF(entries);
+    return 0;
+}
+
+int store_cached_export(ExportModuleState * state, PyObject * cache_dir, PyObject * path, PyObject * text, Py_ssize_t cache_size) {
+    PyObject * created = PyObject_CallMethod(state->os, "makedirs", "(OiO)", cache_dir, 0777, Py_True);
+    if (!created) {
+        return ignore_cache_error() ? 0 : -1;
+    }
+    Py_DECREF(created);
+
+    PyObject * pid = PyObject_CallMethod(state->os, "getpid", NULL);
+    PyObject * temp_path = pid ? PyUnicode_FromFormat("%U.%S.%lu.tmp", path, pid, PyThread_get_thread_ident()) : NULL;
+    PyObject * data = temp_path ? PyUnicode_AsUTF8String(text) : NULL;
+    PyObject * file = data ? PyObject_CallMethod(state->io, "open", "(Os)", temp_path, "wb") : NULL;
+    PyObject * written = file ? PyObject_CallMethod(file, "write", "(O)", data) : NULL;
+    PyObject * closed = file ? PyObject_CallMethod(file, "close", NULL) : NULL;
+    PyObject * replaced = written && closed ? PyObject_CallMethod(state->os, "replace", "(OO)", temp_path, path) : NULL;
+
+    Py_XDECREF(pid);
+    Py_XDECREF(data);
+    Py_XDECREF(file);
+    Py_XDECREF(written);
+    Py_XDECREF(closed);
+
+    if (!replaced) {
+        if (!ignore_cache_error()) {
+            Py_XDECREF(temp_path);
+            return -1;
+        }
+        if (temp_path) {
+            PyObject * removed = PyObject_CallMethod(state->os, "remove", "(O)", temp_path);
+            if (!removed) {
+                PyErr_Clear();
+            }
+            Py_XDECREF(removed);
+        }
+        Py_XDECREF(temp_path);
+        return 0;
+    }
+
+    Py_DECREF(replaced);
+    Py_DECREF(temp_path);
+    return evict_cached_exports(state, cache_dir, cache_size);
+}
+
+PyObject * export_context(ExportModuleState * state, Exporter exporter, Context * ctx);
+
+PyObject * meth_dumps(PyObject * self, PyObject * args, PyObject * kwargs) {
+    static const char * keywords[] = {
+        "context",
+        "separate_vertex_format",
+        "invalidate_framebuffers",
+        "pack_buffers",
+        "persistent_buffers",
+        "texture_arrays",
+        "frame_replay",
+        "buffer_alignment",
+        "cache_dir",
+        "cache_size",
+        NULL,
+    };
+
+    Context * ctx;
+    Exporter exporter = {};
+    exporter.buffer_alignment = 256;
+    PyObject * cache_dir = Py_None;
+    Py_ssize_t cache_size = 256 * 1024 * 1024;
+
+    int args_ok = PyArg_ParseTupleAndKeywords(
+        args,
+        kwargs,
+        "O|$ppppppiOn",
+        (char **)keywords,
+        &ctx,
+        &exporter.separate_vertex_format,
+        &exporter.invalidate_framebuffers,
+        &exporter.pack_buffers,
+        &exporter.persistent_buffers,
+        &exporter.texture_arrays,
+        &exporter.frame_replay,
+        &exporter.buffer_alignment,
+        &cache_dir,
+        &cache_size
+    );
+
+    if (!args_ok) {
+        return NULL;
+    }
+
+    if (exporter.buffer_alignment < 1 || (exporter.buffer_alignment & (exporter.buffer_alignment - 1))) {
+        PyErr_Format(PyExc_ValueError, "buffer_alignment must be a power of two");
+        return NULL;
+    }
+
+    if (cache_size < 0) {
+        PyErr_Format(PyExc_ValueError, "invalid cache_size");
+        return NULL;
+    }
+
+    ExportModuleState * state = (ExportModuleState *)PyModule_GetState(self);
+
+    if (cache_dir == Py_None) {
+        return export_context(state, exporter, ctx);
+    }
+
+    if (!PyUnicode_FSDecoder(cache_dir, &cache_dir)) {
+        return NULL;
+    }
+
+    PyObject * path = get_cache_path(state, &exporter, ctx, cache_dir);
+    if (!path) {
+        Py_DECREF(cache_dir);
+        return NULL;
+    }
+
+    PyObject * res = load_cached_export(state, path);
+    if (!res && !PyErr_Occurred()) {
+        res = export_context(state, exporter, ctx);
+        if (res && store_cached_export(state, cache_dir, path, res, cache_size) < 0) {
+            Py_CLEAR(res);
+        }
+    }
+
+    Py_DECREF(cache_dir);
+    Py_DECREF(path);
+    return res;
+}
+
+PyObject * export_context(ExportModuleState * state, Exporter exporter, Context * ctx) {
+    Stream out = {};
+    GCHeader * it;
+    PyObject * key;
+    GLObject * value;
+    Py_ssize_t pos;
+    bool failed = false;
+
+    exporter.buffer_offsets = PyDict_New();
+    exporter.ring_strides = PyDict_New();
+    exporter.texture_layers = PyDict_New();
+    exporter.vertex_layouts = PyDict_New();
+    exporter.vertex_arrays = PyDict_New();
+    exporter.framebuffers = PyDict_New();
+    exporter.image_uses = PyDict_New();
+    exporter.sampled_images = PySet_New(NULL);
+    exporter.current_vertex_layout = -1;
+    exporter.current_vertex_array = -1;
+
+    for (int i = 0; i < MAX_SAMPLER_BINDINGS; ++i) {
+        exporter.current_textures[i] = 0;
+        exporter.current_samplers[i] = -1;
+    }
+
+    if (!exporter.buffer_offsets || !exporter.ring_strides || !exporter.texture_layers || !exporter.vertex_layouts || !exporter.vertex_arrays || !exporter.framebuffers || !exporter.image_uses || !exporter.sampled_images) {
+        release_exporter(&exporter);
+        release_stream(&out);
+        return NULL;
+    }
+
+    if (exporter.pack_buffers) {
+        int pool_size = pack_buffers(&exporter, ctx);
+        if (pool_size < 0) {
+            release_exporter(&exporter);
+            release_stream(&out);
+            return NULL;
+        }
+        if (pool_size) {
+            print_buffer_pool(&out, &exporter, pool_size);
+            it = ctx->gc_next;
+            while (it != (GCHeader *)ctx) {
+                if (Py_TYPE(it) == ctx->module_state->Buffer_type && !((Buffer *)it)->dynamic) {
+                    print_pooled_buffer(&out, &exporter, (Buffer *)it);
+                }
+                it = it->gc_next;
+            }
+            print_stream(&out, "\n");
+        }
+    }
+
+    if (exporter.persistent_buffers) {
+        if (assign_ring_strides(&exporter, ctx) < 0) {
+            release_exporter(&exporter);
+            release_stream(&out);
+            return NULL;
+        }
+        if (PyDict_Size(exporter.ring_strides)) {
+            print_global(&out, &exporter, "int buffer_ring = 0;\n");
+            print_global(&out, &exporter, "GLsync buffer_fence[%d] = {};\n", RING_SIZE);
+            for (int i = 0; i < RING_SIZE; ++i) {
+                print_release(&exporter, "glDeleteSync(buffer_fence[%d]);\n", i);
+                print_release(&exporter, "buffer_fence[%d] = NULL;\n", i);
+            }
+            print_release(&exporter, "buffer_ring = 0;\n");
+            print_stream(&out, "\n");
+        }
+    }
+
+    it = ctx->gc_next;
+    while (it != (GCHeader *)ctx) {
+        if (Py_TYPE(it) == ctx->module_state->Buffer_type && get_buffer_offset(&exporter, ((Buffer *)it)->buffer) < 0) {
+            int ring_stride = get_ring_stride(&exporter, ((Buffer *)it)->buffer);
+            if (ring_stride >= 0) {
+                print_ring_buffer(&out, &exporter, (Buffer *)it, ring_stride);
+            } else {
+                print_buffer(&out, &exporter, (Buffer *)it);
+            }
+            print_stream(&out, "\n");
+        }
+        it = it->gc_next;
+    }
+
+    PyObject * texture_arrays = NULL;
+
+    if (exporter.texture_arrays) {
+        texture_arrays = group_texture_arrays(&exporter, ctx);
+        if (!texture_arrays) {
+            release_exporter(&exporter);
+            release_stream(&out);
+            return NULL;
+        }
+    }
+
+    it = ctx->gc_next;
+    while (it != (GCHeader *)ctx) {
+        if (Py_TYPE(it) == ctx->module_state->Image_type && (((Image *)it)->renderbuffer || !get_texture_layer(&exporter, ((Image *)it)->image))) {
+            print_image(&out, &exporter, (Image *)it);
+            print_stream(&out, "\n");
+        }
+        it = it->gc_next;
+    }
+
+    for (int i = 0; texture_arrays && i < (int)PyList_Size(texture_arrays); ++i) {
+        print_texture_array(&out, &exporter, i, PyList_GetItem(texture_arrays, i));
+        print_stream(&out, "\n");
+    }
+
+    Py_XDECREF(texture_arrays);
+
+    Py_BEGIN_CRITICAL_SECTION(ctx->sampler_cache);
+    pos = 0;
+    while (PyDict_Next(ctx->sampler_cache, &pos, &key, (PyObject **)&value)) {
+        print_sampler(&out, &exporter, value->obj, key);
+        print_stream(&out, "\n");
+    }
+    Py_END_CRITICAL_SECTION();
+
+    Py_BEGIN_CRITICAL_SECTION(ctx->framebuffer_cache);
+    pos = 0;
+    while (PyDict_Next(ctx->framebuffer_cache, &pos, &key, (PyObject **)&value)) {
+        PyObject * framebuffer_key = PyLong_FromLong(value->obj);
+        if (!framebuffer_key || PyDict_SetItem(exporter.framebuffers, framebuffer_key, key) < 0) {
+            Py_XDECREF(framebuffer_key);
+            failed = true;
+            break;
+        }
+        Py_DECREF(framebuffer_key);
+        print_framebuffer(&out, &exporter, value->obj, key);
+        print_stream(&out, "\n");
+    }
+    Py_END_CRITICAL_SECTION();
+
+    if (failed) {
+        release_exporter(&exporter);
+        release_stream(&out);
+        return NULL;
+    }
+
+    Py_BEGIN_CRITICAL_SECTION(ctx->vertex_array_cache);
+    pos = 0;
+    while (PyDict_Next(ctx->vertex_array_cache, &pos, &key, (PyObject **)&value)) {
+        PyObject * vertex_layout = Py_None;
+        if (exporter.separate_vertex_format) {
+            PyObject * layout_key = vertex_layout_key(key);
+            if (!layout_key) {
+                failed = true;
+                break;
+            }
+            vertex_layout = PyDict_GetItem(exporter.vertex_layouts, layout_key);
+            if (!vertex_layout) {
+                vertex_layout = PyLong_FromSsize_t(PyDict_Size(exporter.vertex_layouts));
+                if (!vertex_layout || PyDict_SetItem(exporter.vertex_layouts, layout_key, vertex_layout) < 0) {
+                    Py_XDECREF(vertex_layout);
+                    Py_DECREF(layout_key);
+                    failed = true;
+                    break;
+                }
+                Py_DECREF(vertex_layout);
+                print_vertex_layout(&out, &exporter, PyLong_AsLong(vertex_layout), key);
+                print_stream(&out, "\n");
+            }
+            Py_DECREF(layout_key);
+        } else {
+            print_vertex_array(&out, &exporter, value->obj, key);
+            print_stream(&out, "\n");
+        }
+        PyObject * vertex_array_key = PyLong_FromLong(value->obj);
+        PyObject * vertex_array = Py_BuildValue("(OO)", vertex_layout, key);
+        if (!vertex_array_key || !vertex_array || PyDict_SetItem(exporter.vertex_arrays, vertex_array_key, vertex_array) < 0) {
+            Py_XDECREF(vertex_array_key);
+            Py_XDECREF(vertex_array);
+            failed = true;
+            break;
+        }
+        Py_DECREF(vertex_array_key);
+        Py_DECREF(vertex_array);
+    }
+    Py_END_CRITICAL_SECTION();
+
+    if (failed) {
+        release_exporter(&exporter);
+        release_stream(&out);
+        return NULL;
+    }
+
+    Py_BEGIN_CRITICAL_SECTION(ctx->shader_cache);
+    pos = 0;
+    while (PyDict_Next(ctx->shader_cache, &pos, &key, (PyObject **)&value)) {
+        PyObject * decoded = PyObject_CallMethod(PyTuple_GetItem(key, 0), "decode", NULL);
+        if (!decoded) {
+            failed = true;
+            break;
+        }
+        PyObject * compact = PyObject_CallMethod(state->compact_lines, "sub", "(sN)", "\n", decoded);
+        if (!compact) {
+            failed = true;
+            break;
+        }
+        PyObject * src = PyObject_CallMethod(state->json, "dumps", "(N)", compact);
+        if (!src) {
+            failed = true;
+            break;
+        }
+        print_shader(&out, &exporter, src, value->obj, PyLong_AsLong(PyTuple_GetItem(key, 1)));
+        Py_DECREF(src);
+        print_stream(&out, "\n");
+    }
+    Py_END_CRITICAL_SECTION();
+
+    if (failed) {
+        release_exporter(&exporter);
+        release_stream(&out);
+        return NULL;
+    }
+
+    Py_BEGIN_CRITICAL_SECTION2(ctx->program_cache, ctx->shader_cache);
+    pos = 0;
+    while (PyDict_Next(ctx->program_cache, &pos, &key, (PyObject **)&value)) {
+        int vertex_shader = ((GLObject *)PyDict_GetItem(ctx->shader_cache, PyTuple_GetItem(key, 0)))->obj;
+        int fragment_shader = ((GLObject *)PyDict_GetItem(ctx->shader_cache, PyTuple_GetItem(key, 1)))->obj;
+        print_program(&out, &exporter, value->obj, vertex_shader, fragment_shader);
+        if (samples_texture_arrays(&exporter, ctx, value->obj)) {
+            print_texture_layers_location(&out, &exporter, value->obj);
+        }
+        print_stream(&out, "\n");
+    }
+    Py_END_CRITICAL_SECTION2();
+
+    print_default_settings(&out);
+    print_stream(&out, "\n");
+
+    int final_framebuffer = -1;
+
+    it = ctx->gc_next;
+    while (it != (GCHeader *)ctx) {
+        if (Py_TYPE(it) == ctx->module_state->Pipeline_type) {
+            if (mark_pipeline_uses(&exporter, (Pipeline *)it) < 0) {
+                release_exporter(&exporter);
+                release_stream(&out);
+                return NULL;
+            }
+            final_framebuffer = ((Pipeline *)it)->framebuffer->obj;
+            exporter.pipeline_index += 1;
+        }
+        it = it->gc_next;
+    }
+
+    PyObject * final_attachments = get_framebuffer_attachments(&exporter, final_framebuffer);
+    if (final_attachments && PyTuple_Size(PyTuple_GetItem(final_attachments, 1))) {
+        Image * final_image = ((ImageFace *)PyTuple_GetItem(PyTuple_GetItem(final_attachments, 1), 0))->image;
+        if (mark_image_use(&exporter, final_image->renderbuffer, final_image->image, false) < 0) {
+            release_exporter(&exporter);
+            release_stream(&out);
+            return NULL;
+        }
+    }
+
+    exporter.pipeline_index = 0;
+
+    if (exporter.frame_replay) {
+        PyObject * res = export_frame_replay(&exporter, ctx, &out, final_framebuffer);
+        release_exporter(&exporter);
+        release_stream(&out);
+        return res;
+    }
+
+    if (PyDict_Size(exporter.ring_strides)) {
+        print_ring_begin(&out, &exporter, ctx);
+        if (!exporter.separate_vertex_format) {
+            print_vertex_array_ring_offsets(&out, &exporter);
+        }
+        print_stream(&out, "\n");
+    }
+
+    it = ctx->gc_next;
+    while (it != (GCHeader *)ctx) {
+        if (Py_TYPE(it) == ctx->module_state->Pipeline_type) {
+            if (print_pipeline(&out, &exporter, (Pipeline *)it) < 0) {
+                failed = true;
+                break;
+            }
+            print_stream(&out, "\n");
+            exporter.pipeline_index += 1;
+        }
+        it = it->gc_next;
+    }
+
+    if (failed || print_blit_framebuffer(&out, &exporter, final_framebuffer) < 0) {
+        release_exporter(&exporter);
+        release_stream(&out);
+        return NULL;
+    }
+
+    if (PyDict_Size(exporter.ring_strides)) {
+        print_ring_end(&out);
+    }
+    PyObject * res = out.failed ? PyErr_NoMemory() : PyUnicode_FromStringAndSize(out.data, out.size);
+    release_exporter(&exporter);
+    release_stream(&out);
+    return res;
+}
+
+int module_exec(PyObject * self) {
+    ExportModuleState * state = (ExportModuleState *)PyModule_GetState(self);
+
+    state->json = PyImport_ImportModule("json");
+    if (!state->json) {
+        return -1;
+    }
+
+    PyObject * regex = PyImport_ImportModule("re");
+    if (!regex) {
+        return -1;
+    }
+
+    state->compact_lines = PyObject_CallMethod(regex, "compile", "(sN)", "\\s*\\n\\s*", PyObject_GetAttrString(regex, "M"));
+    Py_DECREF(regex);
+    if (!state->compact_lines) {
+        return -1;
+    }
+
+    state->hashlib = PyImport_ImportModule("hashlib");
+    state->io = PyImport_ImportModule("io");
+    state->os = PyImport_ImportModule("os");
+    state->os_path = state->os ? PyObject_GetAttrString(state->os, "path") : NULL;
+    state->mmap = PyImport_ImportModule("mmap");
+    state->time = PyImport_ImportModule("time");
+    if (!state->hashlib || !state->io || !state->os || !state->os_path || !state->mmap || !state->time) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int module_traverse(PyObject * self, visitproc visit, void * arg) {
+    ExportModuleState * state = (ExportModuleState *)PyModule_GetState(self);
+    Py_VISIT(state->json);
+    Py_VISIT(state->compact_lines);
+    Py_VISIT(state->hashlib);
+    Py_VISIT(state->io);
+    Py_VISIT(state->os);
+    Py_VISIT(state->os_path);
+    Py_VISIT(state->mmap);
+    Py_VISIT(state->time);
+    return 0;
+}
+
+int module_clear(PyObject * self) {
+    ExportModuleState * state = (ExportModuleState *)PyModule_GetState(self);
+    Py_CLEAR(state->json);
+    Py_CLEAR(state->compact_lines);
+    Py_CLEAR(state->hashlib);
+    Py_CLEAR(state->io);
+    Py_CLEAR(state->os);
+    Py_CLEAR(state->os_path);
+    Py_CLEAR(state->mmap);
+    Py_CLEAR(state->time);
+    return 0;
+}
+
+void module_free(void * self) {
+    module_clear((PyObject *)self);
+}
+
+PyMethodDef module_methods[] = {
+    {"dumps", (PyCFunction)meth_dumps, METH_VARARGS | METH_KEYWORDS, NULL},
+    {},
+};
+
+PyModuleDef_Slot module_slots[] = {
+    {Py_mod_exec, (void *)module_exec},
+#ifdef Py_mod_multiple_interpreters
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+#ifdef Py_GIL_DISABLED
+    {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+    {},
+};
+
+PyModuleDef module_def = {
+    PyModuleDef_HEAD_INIT, "zengl_export", NULL, sizeof(ExportModuleState), module_methods, module_slots, module_traverse, module_clear, module_free,
+};
+
+extern "C" PyObject * PyInit_zengl_export() {
+    return PyModuleDef_Init(&module_def);
 }